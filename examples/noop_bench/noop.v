@@ -0,0 +1,10 @@
+module noop (
+	input  [31:0] a,
+	input  [31:0] b,
+	input  [ 1:0] op,
+	output [31:0] y
+);
+	assign y = op == 0 ? a + b :
+	           op == 1 ? a - b :
+	           op == 2 ? a & b : a ^ b;
+endmodule
@@ -28,6 +28,8 @@ DbManager::DbManager(const QString &path)
 {
     db = QSqlDatabase::addDatabase("QSQLITE");
     db.setDatabaseName(path);
+    // Wait instead of failing while mcy run holds a lock (e.g. a WAL checkpoint)
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=30000");
 
     if (!db.open()) {
         printf("Error: connection with database fail\n");
@@ -47,8 +49,7 @@ int DbManager::getMutationsCount()
 QStringList DbManager::getSources()
 {
     QStringList sources;
-    QSqlQuery query("SELECT DISTINCT SUBSTR(srctag,0,INSTR(srctag,':')) FROM sources ORDER BY "
-                    "SUBSTR(srctag,0,INSTR(srctag,':'))");
+    QSqlQuery query("SELECT filename FROM src_files WHERE file_id IN (SELECT file_id FROM sources) ORDER BY filename");
     while (query.next()) {
         sources << query.value(0).toString();
     }
@@ -58,9 +59,9 @@ QStringList DbManager::getSources()
 QStringList DbManager::getSourcesLines(QString filename)
 {
     QStringList sources;
-    QSqlQuery query("SELECT SUBSTR(srctag,INSTR(srctag,':')+1) FROM sources WHERE "
-                    "SUBSTR(srctag,0,INSTR(srctag,':')) = \"" +
-                    filename + "\" ORDER BY CAST(SUBSTR(srctag,INSTR(srctag,':')+1) AS INTEGER)");
+    QSqlQuery query("SELECT SUBSTR(srctag,LENGTH(filename)+2) FROM sources JOIN src_files USING (file_id) WHERE "
+                    "filename = \"" +
+                    filename + "\" ORDER BY line_start, col_start");
     while (query.next()) {
         sources << query.value(0).toString();
     }
@@ -99,17 +100,12 @@ QString DbManager::getFileContent(QString filename)
 QMap<QString, QPair<int, int>> DbManager::getCoverage(QString filename)
 {
     QMap<QString, QPair<int, int>> retVal;
-    QString str = "SELECT REPLACE(opt_value,'" + filename +
-                  ":',''),"
-                  "       COUNT(CASE WHEN tag =   'COVERED' THEN 1 END),"
-                  "       COUNT(CASE WHEN tag = 'UNCOVERED' THEN 1 END)"
-                  "   FROM options"
-                  "   JOIN tags ON (options.mutation_id = tags.mutation_id)"
-                  "   WHERE opt_type = 'src'"
-                  "       AND opt_value LIKE '" +
+    QString str = "SELECT line, covered, uncovered"
+                  "   FROM line_tags"
+                  "   WHERE file_id = (SELECT file_id FROM src_files WHERE filename = '" +
                   filename +
-                  ":%' "
-                  "   GROUP BY opt_value ";
+                  "') "
+                  "       AND tagged > 0";
     QSqlQuery query(str);
     while (query.next()) {
         retVal.insert(query.value(0).toString(), QPair<int, int>(query.value(1).toInt(), query.value(2).toInt()));
@@ -120,15 +116,12 @@ QMap<QString, QPair<int, int>> DbManager::getCoverage(QString filename)
 QList<QString> DbManager::getLinesYetToCover(QString filename)
 {
     QList<QString> retVal;
-    QString str = "SELECT REPLACE(opt_value,'" + filename +
-                  ":','') "
-                  "   FROM options"
-                  "   WHERE opt_type = 'src'"
-                  "       AND mutation_id NOT IN (SELECT mutation_id FROM tags)"
-                  "       AND opt_value LIKE '" +
+    QString str = "SELECT DISTINCT line_start"
+                  "   FROM srcloc"
+                  "   WHERE file_id = (SELECT file_id FROM src_files WHERE filename = '" +
                   filename +
-                  ":%' "
-                  "   GROUP BY opt_value ";
+                  "') "
+                  "       AND mutation_id NOT IN (SELECT mutation_id FROM tag_data)";
     QSqlQuery query(str);
     while (query.next()) {
         retVal.append(query.value(0).toString());
@@ -189,7 +182,7 @@ QStringList DbManager::getTagsForMutation(int mutationId)
 QStringList DbManager::getUniqueTags(bool addAllTags)
 {
     QStringList tags;
-    QSqlQuery query("SELECT tag FROM tags GROUP BY tag");
+    QSqlQuery query("SELECT tag FROM tag_names WHERE tag_id IN (SELECT tag_id FROM tag_data) ORDER BY tag");
     if (addAllTags)
         tags << DbManager::ALL_TAGS;
     while (query.next()) {
@@ -202,7 +195,7 @@ QStringList DbManager::getUniqueTags(bool addAllTags)
 QList<int> DbManager::getMutationsNoTags()
 {
     QList<int> retVal;
-    QSqlQuery query("SELECT mutation_id FROM mutations where mutation_id not in (SELECT mutation_id FROM tags)");
+    QSqlQuery query("SELECT mutation_id FROM mutations where mutation_id not in (SELECT mutation_id FROM tag_data)");
     while (query.next()) {
         retVal.append(query.value(0).toInt());
     }
@@ -215,7 +208,7 @@ QList<int> DbManager::getMutationsForTag(QString tag)
         return getMutationsNoTags();
 
     QList<int> retVal;
-    QSqlQuery query("SELECT mutation_id FROM tags WHERE tag = '" + tag + "'");
+    QSqlQuery query("SELECT mutation_id FROM tag_data WHERE tag_id = (SELECT tag_id FROM tag_names WHERE tag = '" + tag + "')");
     while (query.next()) {
         retVal.append(query.value(0).toInt());
     }
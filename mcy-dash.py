@@ -18,7 +18,9 @@ if (not os.path.exists(path)):
 app = Flask(__name__, root_path=path, static_url_path='')
 
 def sqlite3_connect():
-    db = sqlite3.connect("database/db.sqlite3")
+    # mcy run keeps the database in WAL mode, so reading never blocks it;
+    # the timeout only covers checkpoints and schema changes
+    db = sqlite3.connect("database/db.sqlite3", timeout=30)
     return db
 
 def force_shutdown(signum, frame):
@@ -61,7 +63,7 @@ def home():
                 try:
                     time.sleep(2)
                     db = sqlite3_connect()
-                    cnt_queue = db.execute('SELECT COUNT(*) FROM queue WHERE running=1').fetchone()[0]
+                    cnt_queue = db.execute('SELECT COUNT(*) FROM queue_data WHERE running=1').fetchone()[0]
                     db.close()                                        
                 except:
                     print("Problem accessing database...")
@@ -69,13 +71,13 @@ def home():
     try:
         db = sqlite3_connect()
         cnt_mutations = db.execute('SELECT COUNT(*) FROM mutations').fetchone()[0]
-        cnt_queue = db.execute('SELECT COUNT(*) FROM queue').fetchone()[0]
-        cnt_results = db.execute('SELECT COUNT(*) FROM results').fetchone()[0]
+        cnt_queue = db.execute('SELECT COUNT(*) FROM queue_data').fetchone()[0]
+        cnt_results = db.execute('SELECT COUNT(*) FROM result_data').fetchone()[0]
         cnt_sources = db.execute('SELECT COUNT(*) FROM sources').fetchone()[0]
-        results = db.execute('SELECT test, result,COUNT(*),ROUND(count(*) * 100.00 /(SELECT count(*) FROM results),2)  FROM results GROUP BY test, result').fetchall()
-        tags = db.execute('SELECT tag,count(*),ROUND(count(*) * 100.00 /(SELECT count(*) FROM tags),2) FROM tags GROUP BY tag').fetchall()
-        queue = db.execute('SELECT test,CASE running WHEN 0 THEN \'PENDING\' ELSE \'RUNNING\' END,count(*) FROM queue GROUP BY test,running ORDER BY running DESC,test ASC').fetchall()
-        running = db.execute('SELECT count(*) FROM queue WHERE running=1').fetchone()[0]
+        results = db.execute('SELECT test,result,cnt,ROUND(cnt * 100.00 /(SELECT count(*) FROM result_data),2) FROM (SELECT test_id,result_id,COUNT(*) AS cnt FROM result_data GROUP BY test_id,result_id) JOIN tests USING (test_id) JOIN result_values USING (result_id) ORDER BY test,result').fetchall()
+        tags = db.execute('SELECT tag,cnt,ROUND(cnt * 100.00 /(SELECT count(*) FROM tag_data),2) FROM (SELECT tag_id,COUNT(*) AS cnt FROM tag_data GROUP BY tag_id) JOIN tag_names USING (tag_id) ORDER BY tag').fetchall()
+        queue = db.execute('SELECT test,CASE running WHEN 0 THEN \'PENDING\' ELSE \'RUNNING\' END,cnt FROM (SELECT test_id,running,COUNT(*) AS cnt FROM queue_data GROUP BY test_id,running) JOIN tests USING (test_id) ORDER BY running DESC,test ASC').fetchall()
+        running = db.execute('SELECT count(*) FROM queue_data WHERE running=1').fetchone()[0]
         db.close()
     except:
         if (not os.path.exists("database/db.sqlite3")):
@@ -93,10 +95,10 @@ def mutations():
     errorCode = 0
     try:
         db = sqlite3_connect()
-        tags = db.execute('SELECT DISTINCT tag FROM tags').fetchall()
+        tags = db.execute('SELECT tag, tag_id FROM tag_names WHERE tag_id IN (SELECT tag_id FROM tag_data)').fetchall()
         sql = 'SELECT m.mutation_id, m.mutation'
         for tag in tags:
-            sql = sql + ',(select count(*) from tags t where t.mutation_id=m.mutation_id and t.tag==\''+ tag[0] + '\') '
+            sql = sql + ',(select count(*) from tag_data t where t.mutation_id=m.mutation_id and t.tag_id=%d) ' % tag[1]
         sql += ' FROM mutations m'
         mutations = db.execute(sql).fetchall()
         db.close()
@@ -119,7 +121,7 @@ def source():
         filename = request.form['filename']
     try:
         db = sqlite3_connect()
-        files = db.execute('SELECT DISTINCT SUBSTR(srctag,0,INSTR(srctag,\':\')) FROM sources ORDER BY SUBSTR(srctag,0,INSTR(srctag,\':\'))').fetchall()
+        files = db.execute('SELECT filename FROM src_files WHERE file_id IN (SELECT file_id FROM sources) ORDER BY filename').fetchall()
         if filename=="":
             filename = files[0][0]
         sql = 'SELECT data FROM files WHERE filename = "%s"' % filename        
@@ -140,28 +142,12 @@ def source():
         filedata = filedata.replace("\r\n", "\n").replace("\r", "\n")
         num = len(filedata.split('\n'))        
        
-        for src, in db.execute("SELECT DISTINCT srctag FROM sources WHERE srctag LIKE ?", [filename + ":%"]):
-            src = src.replace(filename + ":","")
-            if ("." in src):
-                src = src[:src.index(".")]
-            covercache[src] = types.SimpleNamespace(covered=0, uncovered=0, used=0)
-
-        for src, covered, uncovered in db.execute("""
-            SELECT opt_value,
-                    COUNT(CASE WHEN tag =   'COVERED' THEN 1 END),
-                    COUNT(CASE WHEN tag = 'UNCOVERED' THEN 1 END)
-                FROM options
-                JOIN tags ON (options.mutation_id = tags.mutation_id)
-            WHERE opt_type = 'src'
-                AND opt_value LIKE ?
-            GROUP BY opt_value
-        """, [filename + ":%"]):
-            src = src.replace(filename + ":","")
-            if ("." in src):
-                src = src[:src.index(".")]
-            covercache[src].covered += covered
-            covercache[src].uncovered += uncovered
-            covercache[src].used = 1
+        file_id = db.execute("SELECT file_id FROM src_files WHERE filename = ?", [filename]).fetchone() or [None]
+        for line, in db.execute("SELECT DISTINCT line_start FROM sources WHERE file_id = ?", file_id):
+            covercache[str(line)] = types.SimpleNamespace(covered=0, uncovered=0, used=0)
+
+        for line, covered, uncovered in db.execute("SELECT line, covered, uncovered FROM line_tags WHERE file_id = ? AND tagged > 0", file_id):
+            covercache[str(line)] = types.SimpleNamespace(covered=covered, uncovered=uncovered, used=1)
         db.close()
     except:
         if (not os.path.exists("database/db.sqlite3")):
@@ -2,14 +2,29 @@
 
 import sys, os, re, time, signal
 import subprocess, sqlite3, uuid, shutil
-import types
+import types, selectors, socket, json, hashlib, multiprocessing, heapq, hmac, secrets
 import click
 
 TASKIDX = 0
 TASKDB = dict()
 RUNNING = set()
+EVENTS = None
+TESTSTATS = dict()
+SPECULATING = set()
 DBTRACE = False
 SILENT_SIGPIPE = False
+CGROUP = None
+CGROUP_MAIN = None
+LEASE = None
+LEASE_TIME = 60
+CACHE = None
+COMMIT_INTERVAL = 1.0
+LASTCOMMIT = 0.0
+WORKER_CFG = None
+QUEUE = None
+
+# default results for mutations of a task killed by a [test] limit
+LIMIT_RESULTS = {"timeout": "TIMEOUT", "memlimit": "MEMOUT", "cpulimit": "TIMEOUT"}
 
 def log_warning(msg):
     """Log warning"""
@@ -53,33 +68,431 @@ def root_path():
     """Return root path"""
     return os.path.abspath(os.path.dirname(getattr(sys.modules['__main__'], '__file__')))
 
-def sqlite3_connect(log=True, chkexist=False):
+def sqlite3_connect(log=True, chkexist=False, chkschema=True):
     """Connect to sqlite3 database"""
     if chkexist and not os.path.exists("database/db.sqlite3"):
         log_error_additional("Project database not found.", "Run 'mcy init' to initialize the project.")
     if log:
         log_step("Connecting to database.")
-    database = sqlite3.connect("database/db.sqlite3")
+    database = sqlite3.connect("database/db.sqlite3", timeout=60)
+    tune_database(database)
     if DBTRACE:
         if log:
             log_step("Enable database tracing.")
         database.set_trace_callback(print)
+    if chkexist and chkschema:
+        check_schema(database)
     return database
 
+# Bump when the schema changes and add the upgrade step to MIGRATIONS
+SCHEMA_VERSION = 11
+
+# Indexes of the current schema, created by 'mcy init' and after all steps of 'mcy migrate'
+SCHEMA_INDEXES = """
+    CREATE UNIQUE INDEX IF NOT EXISTS mutations_mutation ON mutations (mutation);
+    CREATE INDEX IF NOT EXISTS sources_file_line ON sources (file_id, line_start);
+    CREATE INDEX IF NOT EXISTS srcloc_file_line ON srcloc (file_id, line_start);
+    CREATE INDEX IF NOT EXISTS srcloc_mutation ON srcloc (mutation_id);
+    CREATE INDEX IF NOT EXISTS executions_test ON executions (test_id, end_time);
+    CREATE INDEX IF NOT EXISTS pruned_representative ON pruned (representative);
+    CREATE INDEX IF NOT EXISTS options_mutation ON options (mutation_id, opt_type);
+    CREATE UNIQUE INDEX IF NOT EXISTS result_data_mutation_test ON result_data (mutation_id, test_id);
+    CREATE INDEX IF NOT EXISTS tag_data_mutation ON tag_data (mutation_id);
+    CREATE INDEX IF NOT EXISTS tag_data_tag ON tag_data (tag_id);
+    CREATE UNIQUE INDEX IF NOT EXISTS queue_data_mutation_test ON queue_data (mutation_id, test_id);
+    CREATE INDEX IF NOT EXISTS queue_data_pending ON queue_data (running, test_id, mutation_id);
+    CREATE INDEX IF NOT EXISTS queue_data_lease_expiry ON queue_data (lease_expiry);
+    CREATE INDEX IF NOT EXISTS queue_data_lease_owner ON queue_data (lease_owner);
+"""
+
+# Source locations ('file.v:12.3-14.9') of mutations and design sources,
+# split into integer columns so coverage queries can use an index
+SRCLOC_SCHEMA = """
+    CREATE TABLE src_files (
+        file_id INTEGER PRIMARY KEY,
+        filename STRING UNIQUE
+    );
+
+    CREATE TABLE srcloc (
+        mutation_id INTEGER,
+        file_id INTEGER,
+        line_start INTEGER,
+        col_start INTEGER,
+        line_end INTEGER,
+        col_end INTEGER
+    );
+"""
+
+class SourceLocations:
+    """Parse source locations, assigning ids to file names"""
+    def __init__(self, db):
+        """constructor"""
+        self.db = db
+        self.file_ids = dict(db.execute("SELECT filename, file_id FROM src_files"))
+
+    def file_id(self, filename):
+        """Return the id of a file name, adding it if needed"""
+        if filename not in self.file_ids:
+            self.file_ids[filename] = self.db.execute("INSERT INTO src_files (filename) VALUES (?)", [filename]).lastrowid
+        return self.file_ids[filename]
+
+    def parse(self, src):
+        """Return (file_id, line_start, col_start, line_end, col_end) tuples for a src attribute"""
+        locs = list()
+        for part in src.split("|"):
+            match = re.match(r"^(.*):([0-9]+)(?:\.([0-9]+))?(?:-([0-9]+)(?:\.([0-9]+))?)?$", part)
+            if not match:
+                continue
+            line_start, col_start = int(match.group(2)), int(match.group(3) or 0)
+            line_end = int(match.group(4)) if match.group(4) else line_start
+            col_end = int(match.group(5)) if match.group(5) else col_start
+            locs.append((self.file_id(match.group(1)), line_start, col_start, line_end, col_end))
+        return locs
+
+# Triggers keeping line_tags up to date. They only use correlated subqueries
+# (no upserts or UPDATE FROM), so they work with SQLite versions before 3.33.
+LINE_TAGS_TRIGGERS = """
+    CREATE TRIGGER line_tags_insert AFTER INSERT ON tag_data BEGIN
+        INSERT OR IGNORE INTO line_tags (file_id, line, tagged, covered, uncovered)
+            SELECT file_id, line_start, 0, 0, 0 FROM srcloc WHERE mutation_id = NEW.mutation_id;
+        UPDATE line_tags SET
+            tagged = tagged + (SELECT COUNT(*) FROM srcloc
+                WHERE mutation_id = NEW.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line),
+            covered = covered + (SELECT COUNT(*) FROM srcloc, tag_names
+                WHERE mutation_id = NEW.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line
+                  AND tag_id = NEW.tag_id AND tag = 'COVERED'),
+            uncovered = uncovered + (SELECT COUNT(*) FROM srcloc, tag_names
+                WHERE mutation_id = NEW.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line
+                  AND tag_id = NEW.tag_id AND tag = 'UNCOVERED')
+          WHERE EXISTS (SELECT 1 FROM srcloc
+                WHERE mutation_id = NEW.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line);
+    END;
+
+    CREATE TRIGGER line_tags_delete AFTER DELETE ON tag_data BEGIN
+        UPDATE line_tags SET
+            tagged = tagged - (SELECT COUNT(*) FROM srcloc
+                WHERE mutation_id = OLD.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line),
+            covered = covered - (SELECT COUNT(*) FROM srcloc, tag_names
+                WHERE mutation_id = OLD.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line
+                  AND tag_id = OLD.tag_id AND tag = 'COVERED'),
+            uncovered = uncovered - (SELECT COUNT(*) FROM srcloc, tag_names
+                WHERE mutation_id = OLD.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line
+                  AND tag_id = OLD.tag_id AND tag = 'UNCOVERED')
+          WHERE EXISTS (SELECT 1 FROM srcloc
+                WHERE mutation_id = OLD.mutation_id AND srcloc.file_id = line_tags.file_id AND line_start = line_tags.line);
+    END;
+"""
+
+# Number of tags, and of COVERED and UNCOVERED tags, of the mutations on each
+# source line, kept up to date by triggers on tag_data
+LINE_TAGS_SCHEMA = """
+    CREATE TABLE line_tags (
+        file_id INTEGER,
+        line INTEGER,
+        tagged INTEGER,
+        covered INTEGER,
+        uncovered INTEGER,
+        PRIMARY KEY (file_id, line)
+    ) WITHOUT ROWID;
+""" + LINE_TAGS_TRIGGERS
+
+# One row per finished task, never updated or deleted
+EXECUTIONS_SCHEMA = """
+    CREATE TABLE executions (
+        task STRING,
+        test_id INTEGER,
+        batch INTEGER,
+        start_time REAL,
+        end_time REAL,
+        exit_code INTEGER,
+        cputime REAL,
+        peakmemory INTEGER,
+        host STRING,
+        limit_hit STRING
+    );
+"""
+
+# Structural hash of the optimized mutated module of each mutation checked
+# by 'mcy prune'. noop is set if it equals the optimized original module,
+# representative is the first mutation with the same hash (NULL for itself).
+PRUNED_SCHEMA = """
+    CREATE TABLE pruned (
+        mutation_id INTEGER PRIMARY KEY,
+        struct_hash STRING,
+        noop BOOL,
+        representative INTEGER
+    );
+"""
+
+# Result of the cone of influence analysis of each mutation, observable is
+# cleared if the mutated signal can not reach an output of a top module or
+# an assertion
+OBSERVABLE_SCHEMA = """
+    CREATE TABLE observable (
+        mutation_id INTEGER PRIMARY KEY,
+        observable BOOL
+    );
+"""
+
+# Test invocations, result values and tag names are stored once in
+# dictionary tables; results, tags and queue are views on the integer
+# tables, so queries (and inserts) using the strings keep working.
+INTERNED_SCHEMA = """
+    CREATE TABLE tests (
+        test_id INTEGER PRIMARY KEY,
+        test STRING UNIQUE
+    );
+
+    CREATE TABLE result_values (
+        result_id INTEGER PRIMARY KEY,
+        result STRING UNIQUE
+    );
+
+    CREATE TABLE tag_names (
+        tag_id INTEGER PRIMARY KEY,
+        tag STRING UNIQUE
+    );
+
+    CREATE TABLE result_data (
+        mutation_id INTEGER,
+        test_id INTEGER,
+        result_id INTEGER
+    );
+
+    CREATE TABLE tag_data (
+        mutation_id INTEGER,
+        tag_id INTEGER
+    );
+
+    CREATE TABLE queue_data (
+        mutation_id INTEGER,
+        test_id INTEGER,
+        running BOOL,
+        lease_owner STRING,
+        lease_expiry REAL
+    );
+
+    CREATE VIEW results AS
+        SELECT result_data.rowid AS rowid, mutation_id, test, result FROM result_data
+            JOIN tests USING (test_id) JOIN result_values USING (result_id);
+
+    CREATE TRIGGER results_insert INSTEAD OF INSERT ON results BEGIN
+        INSERT OR IGNORE INTO tests (test) VALUES (NEW.test);
+        INSERT OR IGNORE INTO result_values (result) VALUES (NEW.result);
+        INSERT INTO result_data (mutation_id, test_id, result_id) VALUES (NEW.mutation_id,
+            (SELECT test_id FROM tests WHERE test = NEW.test), (SELECT result_id FROM result_values WHERE result = NEW.result));
+    END;
+
+    CREATE TRIGGER results_delete INSTEAD OF DELETE ON results BEGIN
+        DELETE FROM result_data WHERE rowid = OLD.rowid;
+    END;
+
+    CREATE VIEW tags AS
+        SELECT tag_data.rowid AS rowid, mutation_id, tag FROM tag_data JOIN tag_names USING (tag_id);
+
+    CREATE TRIGGER tags_insert INSTEAD OF INSERT ON tags BEGIN
+        INSERT OR IGNORE INTO tag_names (tag) VALUES (NEW.tag);
+        INSERT INTO tag_data (mutation_id, tag_id) VALUES (NEW.mutation_id, (SELECT tag_id FROM tag_names WHERE tag = NEW.tag));
+    END;
+
+    CREATE TRIGGER tags_delete INSTEAD OF DELETE ON tags BEGIN
+        DELETE FROM tag_data WHERE rowid = OLD.rowid;
+    END;
+
+    CREATE VIEW queue AS
+        SELECT queue_data.rowid AS rowid, mutation_id, test, running, lease_owner, lease_expiry FROM queue_data JOIN tests USING (test_id);
+
+    CREATE TRIGGER queue_insert INSTEAD OF INSERT ON queue BEGIN
+        INSERT OR IGNORE INTO tests (test) VALUES (NEW.test);
+        INSERT INTO queue_data (mutation_id, test_id, running, lease_owner, lease_expiry) VALUES (NEW.mutation_id,
+            (SELECT test_id FROM tests WHERE test = NEW.test), NEW.running, NEW.lease_owner, NEW.lease_expiry);
+    END;
+
+    CREATE TRIGGER queue_update INSTEAD OF UPDATE ON queue BEGIN
+        UPDATE queue_data SET running = NEW.running, lease_owner = NEW.lease_owner, lease_expiry = NEW.lease_expiry WHERE rowid = OLD.rowid;
+    END;
+
+    CREATE TRIGGER queue_delete INSTEAD OF DELETE ON queue BEGIN
+        DELETE FROM queue_data WHERE rowid = OLD.rowid;
+    END;
+"""
+
+def schema_version(db):
+    """Schema version of a project database (1 for databases without version table)"""
+    if db.execute("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'schema'").fetchone()[0] == 0:
+        return 1
+    return db.execute("SELECT MAX(version) FROM schema").fetchone()[0]
+
+def execute_schema(db, script):
+    """Run the statements of a schema script in the current transaction
+
+       Unlike executescript, this does not commit first, so a migration can
+       be rolled back as a whole."""
+    statement = ""
+    for line in script.splitlines(keepends=True):
+        statement += line
+        if sqlite3.complete_statement(statement):
+            db.execute(statement)
+            statement = ""
+    if statement.strip():
+        db.execute(statement)
+
+def migrate_v2(db):
+    """Add queue leases, indexes and unique results"""
+    columns = [col[1] for col in db.execute("PRAGMA table_info(queue)")]
+    if "lease_owner" not in columns:
+        db.execute("ALTER TABLE queue ADD COLUMN lease_owner STRING")
+        db.execute("ALTER TABLE queue ADD COLUMN lease_expiry REAL")
+        # entries left running by an older version are reclaimed right away
+        db.execute("UPDATE queue SET lease_expiry = 0 WHERE running = 1")
+    # only the most recent of duplicate results was ever used
+    db.execute("DELETE FROM results WHERE rowid NOT IN (SELECT MAX(rowid) FROM results GROUP BY mutation_id, test)")
+    db.execute("DELETE FROM queue WHERE rowid NOT IN (SELECT MAX(rowid) FROM queue GROUP BY mutation_id, test)")
+    db.execute("CREATE TABLE schema (version INTEGER)")
+
+def migrate_v3(db):
+    """Make mutations unique"""
+    # keep the first of duplicate mutations, with all its results
+    duplicates = "SELECT mutation_id FROM mutations WHERE mutation_id NOT IN (SELECT MIN(mutation_id) FROM mutations GROUP BY mutation)"
+    for table in ("options", "results", "tags", "queue"):
+        db.execute(f"DELETE FROM {table} WHERE mutation_id IN ({duplicates})")
+    db.execute(f"DELETE FROM mutations WHERE mutation_id IN ({duplicates})")
+
+def migrate_v4(db):
+    """Intern tests, result values and tag names"""
+    for table in ("results", "tags", "queue"):
+        db.execute(f"ALTER TABLE {table} RENAME TO old_{table}")
+    execute_schema(db, INTERNED_SCHEMA)
+    db.execute("INSERT INTO tests (test) SELECT test FROM old_results UNION SELECT test FROM old_queue")
+    db.execute("INSERT INTO result_values (result) SELECT DISTINCT result FROM old_results")
+    db.execute("INSERT INTO tag_names (tag) SELECT DISTINCT tag FROM old_tags")
+    db.execute("""INSERT INTO result_data (mutation_id, test_id, result_id)
+        SELECT mutation_id, test_id, result_id FROM old_results JOIN tests USING (test) JOIN result_values USING (result)""")
+    db.execute("INSERT INTO tag_data (mutation_id, tag_id) SELECT mutation_id, tag_id FROM old_tags JOIN tag_names USING (tag)")
+    db.execute("""INSERT INTO queue_data (mutation_id, test_id, running, lease_owner, lease_expiry)
+        SELECT mutation_id, test_id, running, lease_owner, lease_expiry FROM old_queue JOIN tests USING (test)""")
+    for table in ("results", "tags", "queue"):
+        db.execute(f"DROP TABLE old_{table}")
+
+def migrate_v5(db):
+    """Add parsed source locations"""
+    for column in ("file_id", "line_start", "col_start", "line_end", "col_end"):
+        db.execute(f"ALTER TABLE sources ADD COLUMN {column} INTEGER")
+    execute_schema(db, SRCLOC_SCHEMA)
+    srclocs = SourceLocations(db)
+    for rowid, srctag in db.execute("SELECT rowid, srctag FROM sources").fetchall():
+        for loc in srclocs.parse(srctag)[:1]:
+            db.execute("UPDATE sources SET file_id = ?, line_start = ?, col_start = ?, line_end = ?, col_end = ? WHERE rowid = ?", loc + (rowid,))
+    db.executemany("INSERT INTO srcloc (mutation_id, file_id, line_start, col_start, line_end, col_end) VALUES (?, ?, ?, ?, ?, ?)",
+            ((mid,) + loc for mid, src in db.execute("SELECT mutation_id, opt_value FROM options WHERE opt_type = 'src'").fetchall()
+                for loc in srclocs.parse(src)))
+
+def migrate_v6(db):
+    """Add execution history"""
+    execute_schema(db, EXECUTIONS_SCHEMA)
+
+def migrate_v7(db):
+    """Add per-line tag counts"""
+    execute_schema(db, LINE_TAGS_SCHEMA)
+    db.execute("""INSERT INTO line_tags (file_id, line, tagged, covered, uncovered)
+        SELECT file_id, line_start, COUNT(*), SUM(tag = 'COVERED'), SUM(tag = 'UNCOVERED')
+          FROM srcloc JOIN tag_data USING (mutation_id) JOIN tag_names USING (tag_id) GROUP BY file_id, line_start""")
+
+def migrate_v8(db):
+    """Add hash of the [logic] inputs of each mutation"""
+    db.execute("ALTER TABLE mutations ADD COLUMN logic_hash STRING")
+
+def migrate_v9(db):
+    """Add structural hashes of pruned mutations"""
+    execute_schema(db, PRUNED_SCHEMA)
+
+def migrate_v10(db):
+    """Add observability of mutations"""
+    execute_schema(db, OBSERVABLE_SCHEMA)
+
+def migrate_v11(db):
+    """Replace line_tags triggers needing SQLite 3.33"""
+    db.execute("DROP TRIGGER line_tags_insert")
+    db.execute("DROP TRIGGER line_tags_delete")
+    execute_schema(db, LINE_TAGS_TRIGGERS)
+
+MIGRATIONS = {2: migrate_v2, 3: migrate_v3, 4: migrate_v4, 5: migrate_v5, 6: migrate_v6, 7: migrate_v7, 8: migrate_v8, 9: migrate_v9, 10: migrate_v10,
+              11: migrate_v11}
+
+def check_schema(db):
+    """Abort if the project database does not use the current schema"""
+    version = schema_version(db)
+    if version < SCHEMA_VERSION:
+        log_error_additional(f"Project database uses schema version {version}, this version of MCY needs {SCHEMA_VERSION}.",
+                             "Run 'mcy migrate' to upgrade it.")
+    if version > SCHEMA_VERSION:
+        log_error(f"Project database uses schema version {version}, which is newer than this version of MCY ({SCHEMA_VERSION}).")
+
+def init_lease(db):
+    """Set up the owner of this process's queue leases"""
+    global LEASE
+    host = socket.gethostname()
+    LEASE = types.SimpleNamespace(db=db, owner="%s:%d:%s" % (host, os.getpid(), uuid.uuid4().hex[:8]), renewed=time.time())
+    # Leases of processes on this host that no longer exist need not expire first
+    for owner, in db.execute("SELECT DISTINCT lease_owner FROM queue_data WHERE lease_owner IS NOT NULL").fetchall():
+        owner_host, pid, _ = owner.rsplit(":", 2)
+        if owner_host != host or int(pid) == os.getpid():
+            continue
+        try:
+            os.kill(int(pid), 0)
+        except ProcessLookupError:
+            db.execute("UPDATE queue_data SET running = 0, lease_owner = NULL, lease_expiry = NULL WHERE lease_owner = ?", [owner])
+        except OSError:
+            pass
+    db.commit()
+
+def renew_leases(force=False):
+    """Extend the leases of this process's queue entries (heartbeat)"""
+    if LEASE is None or len(RUNNING) == 0:
+        return
+    now = time.time()
+    if not force and now - LEASE.renewed < LEASE_TIME / 4:
+        return
+    LEASE.db.execute("UPDATE queue_data SET lease_expiry = ? WHERE lease_owner = ?", [now + LEASE_TIME, LEASE.owner])
+    LEASE.db.commit()
+    LEASE.renewed = now
+
+def tune_database(db):
+    """Use WAL journaling, so readers like mcy-dash never block (and are never blocked by) mcy run"""
+    db.execute("PRAGMA journal_mode = WAL")
+    db.execute("PRAGMA synchronous = NORMAL")
+    db.execute("PRAGMA cache_size = -65536")
+
+def commit_results(db, force=False):
+    """Commit recorded results, at most once per COMMIT_INTERVAL unless forced"""
+    global LASTCOMMIT
+    if not force and time.time() - LASTCOMMIT < COMMIT_INTERVAL:
+        return
+    if db.in_transaction:
+        db.commit()
+    if CACHE is not None and CACHE.db.in_transaction:
+        CACHE.db.commit()
+    LASTCOMMIT = time.time()
+
 def exit_mcy(return_code):
     """Exit MCY and cleanup"""
     for task in list(TASKDB.values()):
         task.term()
-    if len(RUNNING)>0:
-        database = sqlite3_connect(log=False)
+    if LEASE is not None:
+        try:
+            commit_results(LEASE.db, force=True)
+        except Exception:
+            pass
+    if len(RUNNING)>0 and LEASE is not None:
+        database = LEASE.db
         log_step("Remove 'RUNNING' status for tasks from queue.")
         try:
-            for mut, tst in RUNNING:
-                database.execute("UPDATE queue SET running = 0 WHERE mutation_id = ? AND test = ?", [mut, tst])
+            database.execute("UPDATE queue_data SET running = 0, lease_owner = NULL, lease_expiry = NULL WHERE lease_owner = ?", [LEASE.owner])
             database.commit()
         except Exception:
             click.secho("==> ERROR : ", fg="red", nl=False, bold=True, err=True)
             click.secho("Error doing MCY cleanup.", fg="white", bold=True, err=True)
+    cleanup_cgroup()
     sys.exit(return_code)
 
 def force_shutdown(signum, frame):
@@ -95,6 +508,13 @@ def xorshift32(x):
     x = (x ^ x <<  5) & 0xFFFFFFFF
     return x
 
+def parse_size(value):
+    """Parse a memory size with optional K/M/G/T suffix (default M) into bytes"""
+    match = re.match(r"^([0-9.]+)([KMGT]?)B?$", value.upper())
+    if not match:
+        return None
+    return int(float(match.group(1)) * 1024 ** (" KMGT".index(match.group(2) or "M")))
+
 def read_cfg():
     """Read configuration file"""
     log_step("Reading configuration file.")
@@ -118,9 +538,16 @@ def read_cfg():
     cfg.script = list()
     cfg.logic = list()
     cfg.report = list()
+    cfg.compiled = dict()
+    cfg.logic_digest = None
     cfg.tests = dict()
     cfg.files = dict()
     cfg.select = list()
+    cfg.opt_shard_modules = False
+    cfg.opt_cache = None
+    cfg.opt_cache_scope = "design"
+    cfg.opt_prune_tag = None
+    cfg.opt_unobservable_tag = None
 
     with open("config.mcy", "r") as f:
         section = None
@@ -143,7 +570,15 @@ def read_cfg():
                     if sectionarg not in cfg.tests:
                         cfg.tests[sectionarg] = types.SimpleNamespace()
                         cfg.tests[sectionarg].maxbatchsize = 1
+                        cfg.tests[sectionarg].autobatch = None
+                        cfg.tests[sectionarg].stream = False
+                        cfg.tests[sectionarg].cores = 1
+                        cfg.tests[sectionarg].memory = 0
+                        cfg.tests[sectionarg].exclusive = False
+                        cfg.tests[sectionarg].limits = dict()
+                        cfg.tests[sectionarg].depends = list()
                         cfg.tests[sectionarg].expect = None
+                        cfg.tests[sectionarg].unobservable = None
                         cfg.tests[sectionarg].run = None
                     continue
                 log_error(f"Syntax error in line {linenr} of config.mcy")
@@ -167,6 +602,21 @@ def read_cfg():
                 if len(entries) == 2 and entries[0] == "seed":
                     cfg.opt_seed = int(entries[1])
                     continue
+                if len(entries) == 2 and entries[0] == "shard_modules" and entries[1] in ("on", "off"):
+                    cfg.opt_shard_modules = entries[1] == "on"
+                    continue
+                if len(entries) == 2 and entries[0] == "cache":
+                    cfg.opt_cache = entries[1]
+                    continue
+                if len(entries) == 2 and entries[0] == "cache_scope" and entries[1] in ("design", "module"):
+                    cfg.opt_cache_scope = entries[1]
+                    continue
+                if len(entries) == 2 and entries[0] == "prune_tag":
+                    cfg.opt_prune_tag = entries[1]
+                    continue
+                if len(entries) == 2 and entries[0] == "unobservable_tag":
+                    cfg.opt_unobservable_tag = entries[1]
+                    continue
                 if len(entries) > 1 and entries[0] == "select":
                     cfg.select += entries[1:]
                     continue
@@ -191,12 +641,42 @@ def read_cfg():
                 entries = line.split()
                 if len(entries) == 0:
                     continue
-                if len(entries) == 2 and entries[0] == "maxbatchsize":
+                if len(entries) == 2 and entries[0] == "maxbatchsize" and entries[1] != "auto":
                     cfg.tests[sectionarg].maxbatchsize = int(entries[1])
+                    cfg.tests[sectionarg].autobatch = None
+                    continue
+                if len(entries) in (2, 3) and entries[0] == "maxbatchsize" and entries[1] == "auto":
+                    cfg.tests[sectionarg].autobatch = int(entries[2]) if len(entries) == 3 else 100
+                    continue
+                if len(entries) == 2 and entries[0] == "stream" and entries[1] in ("on", "off"):
+                    cfg.tests[sectionarg].stream = entries[1] == "on"
+                    continue
+                if len(entries) == 2 and entries[0] == "cores" and entries[1].isdigit() and int(entries[1]) > 0:
+                    cfg.tests[sectionarg].cores = int(entries[1])
+                    continue
+                if len(entries) == 2 and entries[0] == "memory" and parse_size(entries[1]) is not None:
+                    cfg.tests[sectionarg].memory = parse_size(entries[1])
+                    continue
+                if len(entries) == 2 and entries[0] == "exclusive" and entries[1] in ("on", "off"):
+                    cfg.tests[sectionarg].exclusive = entries[1] == "on"
+                    continue
+                if len(entries) in (2, 3) and entries[0] in LIMIT_RESULTS:
+                    if entries[0] == "memlimit":
+                        value = parse_size(entries[1])
+                    else:
+                        value = float(entries[1]) if re.match(r"^[0-9]+(\.[0-9]*)?$", entries[1]) else None
+                    if value:
+                        cfg.tests[sectionarg].limits[entries[0]] = (value, entries[2] if len(entries) == 3 else LIMIT_RESULTS[entries[0]])
+                        continue
+                if len(entries) >= 2 and entries[0] == "depends":
+                    cfg.tests[sectionarg].depends += entries[1:]
                     continue
                 if len(entries) >= 2 and entries[0] == "expect":
                     cfg.tests[sectionarg].expect = entries[1:]
                     continue
+                if len(entries) == 2 and entries[0] == "unobservable":
+                    cfg.tests[sectionarg].unobservable = entries[1]
+                    continue
                 if len(entries) >= 2 and entries[0] == "run":
                     match = re.match(r"^\s*run\s*(.*\S)\s*$", line)
                     cfg.tests[sectionarg].run = match.group(1)
@@ -222,111 +702,961 @@ def read_cfg():
         cfg.opt_seed = xorshift32(cfg.opt_seed)
         cfg.opt_seed = cfg.opt_seed % 1000000000
 
+    for option in ("prune_tag", "unobservable_tag"):
+        tag = getattr(cfg, "opt_" + option)
+        if tag is not None and cfg.opt_tags is not None and tag not in cfg.opt_tags:
+            log_error(f"Tag '{tag}' given with '{option}' is not one of the 'tags'.")
+
+    # results written for tasks killed by a limit are always expected
+    for test in cfg.tests.values():
+        if test.expect is not None:
+            test.expect += [res for _, res in test.limits.values() if res not in test.expect]
+    for t, test in cfg.tests.items():
+        if test.unobservable is not None and test.expect is not None and test.unobservable not in test.expect:
+            log_error(f"Result '{test.unobservable}' given with 'unobservable' of test '{t}' is not one of the expected values.")
+
     return cfg
 
 ######################################################
 
-def update_mutation(db, cfg, mid):
-    """Update mutation"""
-    rng_state = xorshift32(xorshift32(mid + cfg.opt_seed))
-    rng_state = xorshift32(xorshift32(rng_state))
+class ResultNotReadyException(BaseException):
+    """ResultNotReadyException"""
+    def __init__(self, tsts):
+        """constructor"""
+        BaseException.__init__(self)
+        self.tsts = tsts
+
+def compile_section(cfg, section):
+    """Compile the [logic] or [report] section once per process
+
+       Returns the function and the namespace it runs in. Callers set the
+       environment functions (result, tag, ..) in the namespace before each call."""
+    if section not in cfg.compiled:
+        env = globals().copy()
+        code = f"def __{section}__():\n  " + "\n  ".join(getattr(cfg, section)) + "\n"
+        exec(compile(code, f"[{section}]", "exec"), env)
+        cfg.compiled[section] = (env[f"__{section}__"], env)
+    return cfg.compiled[section]
+
+class LogicError(BaseException):
+    """Invalid result or tag in [logic]"""
+
+def eval_logic(db, cfg, mid, assumed=None, results=None):
+    """Evaluate [logic] for a mutation without modifying the database
+
+       Returns the list of tags and the list of tests whose results are
+       missing (empty once the logic is complete). Results in assumed take
+       precedence over those in the database, or in results (a test -> result
+       dict) if the caller loaded them."""
+    if results is None:
+        results = dict(db.execute("SELECT test, result FROM results WHERE mutation_id = ?", [mid]))
+    try:
+        return run_logic(cfg, mid, results, assumed)
+    except LogicError as ex:
+        log_error(str(ex))
 
-    db.execute("DELETE FROM queue WHERE mutation_id = ?", [mid])
-    db.execute("DELETE FROM tags WHERE mutation_id = ?", [mid])
+def run_logic(cfg, mid, results, assumed=None):
+    """Evaluate [logic] for a mutation with the given test -> result dict
 
-    class ResultNotReadyException(BaseException):
-        """ResultNotReadyException"""
-        def __init__(self, tst):
-            """constructor"""
-            BaseException.__init__(self)
-            self.tst = tst
+       Raises LogicError for unexpected results and tags."""
+    rng_state = xorshift32(xorshift32(mid + cfg.opt_seed))
+    rng_state = xorshift32(xorshift32(rng_state))
+    tags = list()
 
-    def env_result(tst):
+    def lookup(tst):
         t = tst.split()[0]
-        for res, in db.execute("SELECT (result) FROM results WHERE mutation_id = ? AND test = ?", [mid, tst]):
+        if assumed is not None and tst in assumed:
+            return assumed[tst]
+        if tst in results:
+            res = results[tst]
             if cfg.tests[t].expect is not None:
                 if not res in cfg.tests[t].expect:
-                    log_error(f"Executing {tst} resulted with {res} expecting value(s): {', '.join(cfg.tests[t].expect)}")
+                    raise LogicError(f"Executing {tst} resulted with {res} expecting value(s): {', '.join(cfg.tests[t].expect)}")
             return res
-        raise ResultNotReadyException(tst)
+        return None
+
+    def env_result(tst):
+        res = lookup(tst)
+        if res is None:
+            raise ResultNotReadyException([tst])
+        return res
+
+    def env_need(*tsts):
+        missing = [tst for tst in dict.fromkeys(tsts) if lookup(tst) is None]
+        if len(missing):
+            raise ResultNotReadyException(missing)
 
     def env_tag(tag):
         if cfg.opt_tags is not None:
             if not tag in cfg.opt_tags:
-                log_error(f"Provided tag {tag} not one of expected: {', '.join(cfg.opt_tags)}")
-        db.execute("INSERT INTO tags (mutation_id, tag) VALUES (?, ?)", [mid, tag])
+                raise LogicError(f"Provided tag {tag} not one of expected: {', '.join(cfg.opt_tags)}")
+        tags.append(tag)
 
     def env_rng(n):
         nonlocal rng_state
         rng_state = xorshift32(xorshift32(rng_state))
         return rng_state % n
 
-    gdict = globals().copy()
-    gdict["result"] = env_result
-    gdict["tag"] = env_tag
-    gdict["rng"] = env_rng
+    logic, env = compile_section(cfg, "logic")
+    env["result"] = env_result
+    env["need"] = env_need
+    env["tag"] = env_tag
+    env["rng"] = env_rng
 
     try:
-        code = "def __logic__():\n  " + "\n  ".join(cfg.logic) + "\n__logic__()\n"
-        exec(code, gdict)
+        logic()
     except ResultNotReadyException as ex:
-        db.execute("INSERT INTO queue (mutation_id, test, running) VALUES (?, ?, 0)", [mid, ex.tst])
-
+        return tags, ex.tsts
+    return tags, []
+
+def logic_hash(cfg, results, state=None):
+    """Hash of the inputs of [logic] for a mutation with the given (test_id, result_id) pairs
+
+       state gives the pruning and observability of the mutation, if known."""
+    if cfg.logic_digest is None:
+        # the seed is random unless configured, it only matters if rng() is used
+        logic, _ = compile_section(cfg, "logic")
+        seed = cfg.opt_seed if "rng" in logic.__code__.co_names else None
+        cfg.logic_digest = hashlib.sha256(repr((cfg.logic, seed, sorted(cfg.opt_tags or ()),
+                sorted((t, test.expect) for t, test in cfg.tests.items()))).encode()).hexdigest()
+    inputs = repr(sorted(results))
+    if state is not None and pruned_tag(cfg, state) is not None:
+        inputs = repr(("prune_tag", pruned_tag(cfg, state)))
+    elif state is not None and unobservable(cfg, state):
+        inputs += repr(("unobservable", cfg.opt_unobservable_tag,
+                sorted((t, test.unobservable) for t, test in cfg.tests.items())))
+    return hashlib.sha256((cfg.logic_digest + inputs).encode()).hexdigest()
+
+def pruned_tag(cfg, state):
+    """The prune_tag if 'mcy prune' found the mutation to be a no-op, else None"""
+    return cfg.opt_prune_tag if state.noop else None
+
+def observability_enabled(cfg):
+    """Whether unobservable mutations are tagged or get results without testing"""
+    return cfg.opt_unobservable_tag is not None or any(test.unobservable is not None for test in cfg.tests.values())
+
+def unobservable(cfg, state):
+    """Whether the mutation is never tested, as its mutated signal can not be observed"""
+    return state.unobservable and observability_enabled(cfg)
+
+def unobservable_result(cfg, state, tst):
+    """Result of a test configured for unobservable mutations, None if it has to run"""
+    return cfg.tests[tst.split()[0]].unobservable if unobservable(cfg, state) else None
+
+def scripts_path():
+    """Return path of the scripts shipped with MCY"""
+    script_path = root_path() + '/../share/mcy/scripts' # for install
+    if (not os.path.exists(script_path)):
+        script_path = root_path() + '/scripts' # for development
+    return script_path
+
+def open_cache(cfg):
+    """Open the result cache configured with 'cache' in [options], if any"""
+    global CACHE
+    if CACHE is not None or cfg.opt_cache is None:
+        return CACHE
+    os.makedirs(cfg.opt_cache, exist_ok=True)
+    db = sqlite3.connect(os.path.join(cfg.opt_cache, "results.sqlite3"), timeout=60)
+    tune_database(db)
+    db.execute("CREATE TABLE IF NOT EXISTS results (key STRING PRIMARY KEY, test STRING, result STRING)")
     db.commit()
+    CACHE = types.SimpleNamespace(db=db, modules=None, files=None, tests=dict(), mutations=dict(), hits=0)
+    return CACHE
+
+def module_hashes():
+    """Hash each module of database/design.il together with the modules it instantiates"""
+    modules = dict()
+    with open("database/design.il") as f:
+        name = None
+        for line in f:
+            if line.startswith("module "):
+                name = line.split()[1]
+                modules[name] = (hashlib.sha256(), set())
+            elif name is not None:
+                if line.rstrip() == "end":
+                    name = None
+                    continue
+                modules[name][0].update(line.encode())
+                entries = line.split()
+                if len(entries) == 3 and entries[0] == "cell":
+                    modules[name][1].add(entries[1])
+
+    hashes = dict()
+    def module_hash(name, stack=()):
+        if name not in hashes:
+            digest, cells = modules[name]
+            digest = digest.copy()
+            for cell in sorted(cells):
+                if cell in modules and cell not in stack:
+                    digest.update(module_hash(cell, stack + (name,)).encode())
+            hashes[name] = digest.hexdigest()
+        return hashes[name]
+    for name in modules:
+        module_hash(name)
+    return hashes
+
+def test_hash(cfg, tst):
+    """Hash everything a test depends on besides the mutated design"""
+    t = tst.split()[0]
+    digest = hashlib.sha256()
+    digest.update(repr((tst, cfg.tests[t].run, sorted(cfg.tests[t].limits.items()))).encode())
+    # Scripts named on the run line, e.g. 'bash $PRJDIR/sim.sh', and files
+    # listed with 'depends' contribute their contents
+    files = list()
+    for word in cfg.tests[t].run.split():
+        for var, value in (("PRJDIR", os.getcwd()), ("SCRIPTS", scripts_path())):
+            word = word.replace("${%s}" % var, value).replace("$%s" % var, value)
+        if os.path.isfile(word):
+            files.append(word)
+    for filename in cfg.tests[t].depends:
+        if not os.path.isfile(filename):
+            log_error(f"File '{filename}' listed in 'depends' of test '{t}' not found.")
+        files.append(filename)
+    for filename in files:
+        digest.update(filename.encode())
+        with open(filename, "rb") as f:
+            digest.update(hashlib.sha256(f.read()).digest())
+    return digest.hexdigest()
+
+def cache_key(db, cfg, mid, tst):
+    """Key of a mutation's test result in the cache
+
+       The design part of the key is the whole design, or with 'cache_scope
+       module' only the mutated module and the modules it instantiates. Then
+       the files read by [script] are left out of the [files] part, their
+       contents only matter through the RTLIL."""
+    if CACHE.modules is None:
+        CACHE.modules = module_hashes()
+    if CACHE.files is None:
+        sources = set()
+        if cfg.opt_cache_scope == "module":
+            sources = {token.strip("\"'") for line in cfg.script for token in line.split()}
+        digest = hashlib.sha256()
+        for filename, data in db.execute("SELECT filename, data FROM files ORDER BY filename"):
+            if filename in sources:
+                continue
+            digest.update(filename.encode())
+            digest.update(hashlib.sha256(data).digest())
+        CACHE.files = digest.hexdigest()
+    if tst not in CACHE.tests:
+        CACHE.tests[tst] = test_hash(cfg, tst)
+    if mid not in CACHE.mutations:
+        CACHE.mutations[mid], = db.execute("SELECT mutation FROM mutations WHERE mutation_id = ?", [mid]).fetchone()
+    mut_str = CACHE.mutations[mid]
+    match = re.search(r"-module (\S+)", mut_str)
+    module = CACHE.modules.get(match.group(1)) if match and cfg.opt_cache_scope == "module" else None
+    if module is None:
+        module = hashlib.sha256(b"".join(h.encode() for _, h in sorted(CACHE.modules.items()))).hexdigest()
+    return hashlib.sha256(("%s\n%s\n%s\n%s" % (module, mut_str, CACHE.tests[tst], CACHE.files)).encode()).hexdigest()
+
+def cache_lookup(db, cfg, mid, tst):
+    """Return the cached result of a test for a mutation, None if not cached"""
+    if open_cache(cfg) is None:
+        return None
+    for res, in CACHE.db.execute("SELECT result FROM results WHERE key = ?", [cache_key(db, cfg, mid, tst)]):
+        CACHE.hits += 1
+        return res
+    return None
+
+def cache_store(db, cfg, mid, tst, res):
+    """Store a test result in the cache"""
+    if open_cache(cfg) is None:
+        return
+    CACHE.db.execute("INSERT OR REPLACE INTO results (key, test, result) VALUES (?, ?, ?)", [cache_key(db, cfg, mid, tst), tst, res])
+
+# Mutations per batch evaluated by a worker process in 'mcy reset'
+LOGIC_BATCH = 1000
+
+def init_logic_worker(cfg):
+    """Set up a worker process evaluating [logic]"""
+    global WORKER_CFG
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    signal.signal(signal.SIGTERM, signal.SIG_DFL)
+    WORKER_CFG = cfg
+
+def eval_logic_batch(batch):
+    """Evaluate [logic] for a list of (mutation_id, results) pairs in a worker process
+
+       Returns a list of (mutation_id, tags, queued), or an error message."""
+    try:
+        return [(mid, *run_logic(WORKER_CFG, mid, results)) for mid, results in batch]
+    except LogicError as ex:
+        return str(ex)
+
+def eval_logic_parallel(cfg, states, nproc):
+    """Evaluate [logic] for the given mutation states in worker processes
+
+       Yields (mutation_id, tags, queued) in the order of states."""
+    batches = list()
+    for mid, state in states.items():
+        if len(batches) == 0 or len(batches[-1]) >= LOGIC_BATCH:
+            batches.append(list())
+        batches[-1].append((mid, {tst: res for _, _, tst, res in state.results}))
+    # compiled code and its namespace can not be sent to workers
+    worker_cfg = types.SimpleNamespace(**vars(cfg))
+    worker_cfg.compiled = dict()
+    context = multiprocessing.get_context("fork" if "fork" in multiprocessing.get_all_start_methods() else None)
+    with context.Pool(min(nproc, len(batches)), init_logic_worker, (worker_cfg,)) as pool:
+        for evaluated in pool.imap(eval_logic_batch, batches):
+            if isinstance(evaluated, str):
+                log_error(evaluated)
+            yield from evaluated
+
+def load_mutation_state(db, mid=None):
+    """Load results, tags, queue entries, logic hash, pruning and observability of a mutation, or of all mutations
+
+       Returns a dict mapping mutation ids to the loaded state."""
+    where, args = ("", []) if mid is None else (" WHERE mutation_id = ?", [mid])
+    states = dict()
+    for m, stored_hash, noop, representative, observable in db.execute("""SELECT mutation_id, logic_hash, noop, representative, observable
+            FROM mutations LEFT JOIN pruned USING (mutation_id) LEFT JOIN observable USING (mutation_id)""" + where, args):
+        states[m] = types.SimpleNamespace(results=list(), tags=list(), queue=list(), logic_hash=stored_hash,
+                noop=bool(noop), representative=representative, unobservable=observable is not None and not observable)
+    for m, test_id, result_id, tst, res in db.execute("""SELECT mutation_id, test_id, result_id, test, result
+            FROM result_data JOIN tests USING (test_id) JOIN result_values USING (result_id)""" + where, args):
+        states[m].results.append((test_id, result_id, tst, res))
+    for m, tag in db.execute("SELECT mutation_id, tag FROM tag_data JOIN tag_names USING (tag_id)" + where, args):
+        states[m].tags.append(tag)
+    for m, tst, running in db.execute("SELECT mutation_id, test, running FROM queue_data JOIN tests USING (test_id)" + where, args):
+        states[m].queue.append((tst, bool(running)))
+    return states
+
+def update_mutation(db, cfg, mid, state=None, evaluated=None):
+    """Update mutation, returns the list of queued tests
+
+       Only tags, queue entries and the logic hash that changed are written.
+       evaluated is the (tags, queued) result of [logic] for the loaded
+       state, if the caller already evaluated it. No-op mutations found by
+       'mcy prune' are tagged with prune_tag, duplicates are never queued
+       but get the results of their representative, which the tests they
+       need are queued for instead. Unobservable mutations
+       get the unobservable_tag and the 'unobservable' result of each test
+       [logic] asks for, only tests without such a result are queued."""
+    if state is None:
+        state = load_mutation_state(db, mid)[mid]
+    results = {tst: res for _, _, tst, res in state.results}
+    result_ids = [(test_id, result_id) for test_id, result_id, _, _ in state.results]
+    if pruned_tag(cfg, state) is not None:
+        tags, queued = [pruned_tag(cfg, state)], []
+    else:
+        tags, queued = evaluated if evaluated is not None else eval_logic(db, cfg, mid, results=results)
+    # Results from the cache are used as if the tests had just run
+    while True:
+        hits = [(tst, unobservable_result(cfg, state, tst) or cache_lookup(db, cfg, mid, tst)) for tst in queued if (mid, tst) not in RUNNING]
+        hits = [(tst, res) for tst, res in hits if res is not None]
+        if len(hits) == 0:
+            break
+        for tst, res in hits:
+            db.execute("INSERT INTO results (mutation_id, test, result) VALUES (?, ?, ?)", [mid, tst, res])
+            results[tst] = res
+        result_ids = db.execute("SELECT test_id, result_id FROM result_data WHERE mutation_id = ?", [mid]).fetchall()
+        tags, queued = eval_logic(db, cfg, mid, results=results)
+
+    if unobservable(cfg, state) and pruned_tag(cfg, state) is None and cfg.opt_unobservable_tag is not None and cfg.opt_unobservable_tag not in tags:
+        tags = tags + [cfg.opt_unobservable_tag]
+    if sorted(tags) != sorted(state.tags):
+        db.execute("DELETE FROM tag_data WHERE mutation_id = ?", [mid])
+        for tag in tags:
+            db.execute("INSERT INTO tags (mutation_id, tag) VALUES (?, ?)", [mid, tag])
+    queued = [tst for tst in queued if unobservable_result(cfg, state, tst) is None]
+    if state.representative is not None:
+        queue_for_representative(db, state.representative, queued)
+        queued = []
+    # Entries of tests still needed are kept, they may be leased by another
+    # process. Entries of a representative may be needed by its duplicates.
+    existing = dict(state.queue)
+    stale = [tst for tst in existing if tst not in queued]
+    if len(stale) and state.representative is None:
+        needed = duplicate_tests(db, cfg, mid)
+        stale = [tst for tst in stale if tst not in needed]
+    for tst in existing:
+        if tst in stale:
+            db.execute("DELETE FROM queue_data WHERE mutation_id = ? AND test_id = (SELECT test_id FROM tests WHERE test = ?)", [mid, tst])
+            if QUEUE is not None:
+                QUEUE.discard(mid, tst)
+    for tst in queued:
+        if tst not in existing:
+            db.execute("INSERT INTO queue (mutation_id, test, running) VALUES (?, ?, 0)", [mid, tst])
+            if QUEUE is not None and (mid, tst) not in RUNNING:
+                QUEUE.add(mid, tst)
+        # The test may already be running speculatively
+        if (mid, tst) in RUNNING and not existing.get(tst):
+            mark_running(db, tst, [mid], commit=False)
+
+    new_hash = logic_hash(cfg, result_ids, state)
+    if new_hash != state.logic_hash:
+        db.execute("UPDATE mutations SET logic_hash = ? WHERE mutation_id = ?", [new_hash, mid])
+    return queued
+
+def queue_for_representative(db, mid, tests):
+    """Queue tests a duplicate needs for its representative mid, unless queued or done"""
+    for tst in tests:
+        if db.execute("""SELECT 1 FROM queue_data JOIN tests USING (test_id) WHERE mutation_id = ? AND test = ?
+                UNION ALL SELECT 1 FROM result_data JOIN tests USING (test_id) WHERE mutation_id = ? AND test = ?""",
+                [mid, tst, mid, tst]).fetchone() is None:
+            db.execute("INSERT INTO queue (mutation_id, test, running) VALUES (?, ?, 0)", [mid, tst])
+            if QUEUE is not None and (mid, tst) not in RUNNING:
+                QUEUE.add(mid, tst)
+
+def duplicate_tests(db, cfg, mid):
+    """Tests [logic] still asks for on the duplicates of mutation mid"""
+    needed = set()
+    for dup, in db.execute("SELECT mutation_id FROM pruned WHERE representative = ?", [mid]).fetchall():
+        state = load_mutation_state(db, dup)[dup]
+        if pruned_tag(cfg, state) is None:
+            _, queued = eval_logic(db, cfg, dup, results={tst: res for _, _, tst, res in state.results})
+            needed |= {tst for tst in queued if unobservable_result(cfg, state, tst) is None}
+    return needed
+
+def share_results(db, cfg):
+    """Copy results of representatives missing for their duplicates, and update both"""
+    rows = db.execute("""SELECT pruned.mutation_id, result_data.test_id, result_data.result_id, pruned.representative
+            FROM pruned JOIN result_data ON result_data.mutation_id = pruned.representative
+            WHERE NOT EXISTS (SELECT 1 FROM result_data AS own
+                WHERE own.mutation_id = pruned.mutation_id AND own.test_id = result_data.test_id)""").fetchall()
+    db.executemany("INSERT INTO result_data (mutation_id, test_id, result_id) VALUES (?, ?, ?)", [row[:3] for row in rows])
+    # representatives may no longer need to keep tests queued for them
+    for mid in sorted(set(mid for mid, _, _, _ in rows) | set(head for _, _, _, head in rows)):
+        update_mutation(db, cfg, mid)
+
+def design_modules(cfg, name):
+    """Number of mutable cells per module, within the selection if any"""
+    modules = dict()
+    if len(cfg.select):
+        with open(f"database/{name}_select.ys", "w") as f:
+            print("read_rtlil database/design.il", file=f)
+            print(f"select -set mcy_select {' '.join(cfg.select)}", file=f)
+            print(f"select -write database/{name}_select.txt @mcy_select t:* %i", file=f)
+        task = Task(f"yosys -ql database/{name}_select.log database/{name}_select.ys")
+        task.wait()
+        with open(f"database/{name}_select.txt", "r") as f:
+            for line in f:
+                module = line.strip().split("/", 1)[0]
+                if module:
+                    module = module if module.startswith("$") else "\\" + module
+                    modules[module] = modules.get(module, 0) + 1
+        return modules
+    module = None
+    with open("database/design.il", "r") as f:
+        for line in f:
+            line = line.split()
+            if len(line) >= 2 and line[0] == "module":
+                module = line[-1]
+                modules[module] = 0
+            elif len(line) >= 3 and line[0] == "cell" and module is not None:
+                modules[module] += 1
+    return {module: cnt for module, cnt in modules.items() if cnt}
+
+def write_mutate_script(cfg, filename, size, seed, output, sources, selection):
+    """Write a yosys script listing mutations for a selection"""
+    with open(filename, "w") as f:
+        print("read_rtlil database/design.il", file=f)
+        if selection[:1] == ["@mcy_select"]:
+            print(f"select -set mcy_select {' '.join(cfg.select)}", file=f)
+        print(f"mutate -list {size} -seed {seed} -none{''.join(' -cfg %s %d' % (k, v) for k, v, in sorted(cfg.mutopts.items()))}{' -mode ' + cfg.opt_mode if cfg.opt_mode else ''} -o {output} -s {sources}{' ' + ' '.join(selection) if len(selection) else ''}", file=f)
+
+def generate_mutations(cfg, name, size, nproc=1):
+    """Create database/<name>.txt with up to size mutations
+
+       With opt_shard_modules, each module is mutated by its own yosys process
+       (up to nproc at a time) with a seed derived from opt_seed, and size is
+       split between modules by their number of cells. The lists are
+       interleaved in that proportion, so a prefix of the result draws evenly
+       from all modules."""
+    modules = design_modules(cfg, name) if cfg.opt_shard_modules else dict()
+    if len(modules) < 2:
+        log_step("Creating mutations script file.")
+        write_mutate_script(cfg, f"database/{name}.ys", size, cfg.opt_seed, f"database/{name}.txt", "database/sources.txt", cfg.select)
+        log_step("Creating mutations.")
+        task = Task(f"yosys -ql database/{name}.log database/{name}.ys")
+        task.wait()
+        return
+
+    # largest remainder split of size by cell count
+    total = sum(modules.values())
+    shares = {module: size * cnt // total for module, cnt in modules.items()}
+    for module in sorted(modules, key=lambda m: (-(size * modules[m] % total), m))[:size - sum(shares.values())]:
+        shares[module] += 1
+    shards = [(idx, module, shares[module]) for idx, module in enumerate(sorted(modules)) if shares[module]]
+
+    log_step(f"Creating mutations for {len(shards)} modules.")
+    for idx, module, share in shards:
+        seed = xorshift32(xorshift32(cfg.opt_seed + idx + 1)) % 1000000000
+        selection = ["@mcy_select", module, "%i"] if len(cfg.select) else [module]
+        write_mutate_script(cfg, f"database/{name}_{idx}.ys", share, seed, f"database/{name}_{idx}.txt", f"database/sources_{idx}.txt", selection)
+        Task(f"yosys -ql database/{name}_{idx}.log database/{name}_{idx}.ys")
+        wait_tasks(nproc)
+    wait_tasks(1)
 
-def reset_status(db, cfg, do_reset=False):
-    """Reset status"""
+    log_step("Merging mutations.")
+    mutations, sources = list(), dict()
+    for idx, module, share in shards:
+        with open(f"database/{name}_{idx}.txt", "r") as f:
+            lines = f.readlines()
+        mutations += (((i + 0.5) / len(lines), idx, line) for i, line in enumerate(lines))
+        with open(f"database/sources_{idx}.txt", "r") as f:
+            sources.update((line, None) for line in f)
+        os.remove(f"database/{name}_{idx}.txt")
+        os.remove(f"database/sources_{idx}.txt")
+    with open(f"database/{name}.txt", "w") as f:
+        f.writelines(line for _, _, line in sorted(mutations))
+    with open("database/sources.txt", "w") as f:
+        f.writelines(sources)
+
+def mutation_options(mut_str):
+    """Split a mutation into (option, value) pairs"""
+    options = list()
+    optarray = mut_str.split()
+    skip_next = False
+    for i in range(len(optarray)-1):
+        if skip_next:
+            skip_next = False
+        elif optarray[i].startswith("-"):
+            options.append((optarray[i][1:], optarray[i+1]))
+            skip_next = True
+    return options
+
+def import_mutations(db, lines, limit=None, output=None):
+    """Add mutations not yet in the database, returns the number added
+
+       Mutations are inserted in chunks in the current transaction. If
+       given, the added mutations are also written to output."""
+    known = set(mut for mut, in db.execute("SELECT mutation FROM mutations"))
+    mid, = db.execute("SELECT IFNULL(MAX(mutation_id), 0) FROM mutations").fetchone()
+    srclocs = SourceLocations(db)
+    added = 0
+    mutations, options = list(), list()
+    def flush():
+        db.executemany("INSERT INTO mutations (mutation_id, mutation) VALUES (?, ?)", mutations)
+        db.executemany("INSERT INTO options (mutation_id, opt_type, opt_value) VALUES (?, ?, ?)", options)
+        db.executemany("INSERT INTO srcloc (mutation_id, file_id, line_start, col_start, line_end, col_end) VALUES (?, ?, ?, ?, ?, ?)",
+                ((mid,) + loc for mid, opt_type, opt_value in options if opt_type == "src" for loc in srclocs.parse(opt_value)))
+        mutations.clear()
+        options.clear()
+    for line in lines:
+        if limit is not None and added >= limit:
+            break
+        mut_str = line.rstrip()
+        if mut_str in known:
+            continue
+        known.add(mut_str)
+        mid += 1
+        added += 1
+        mutations.append((mid, mut_str))
+        options += [(mid, opt_type, opt_value) for opt_type, opt_value in mutation_options(mut_str)]
+        if output is not None:
+            print(mut_str, file=output)
+        if len(mutations) >= 10000:
+            flush()
+    flush()
+    return added
+
+def struct_hash(filename):
+    """Hash of a module written by write_rtlil, ignoring attributes"""
+    digest = hashlib.sha256()
+    with open(filename, "r") as f:
+        for line in f:
+            entries = line.split()
+            if len(entries) and entries[0] not in ("attribute", "autoidx"):
+                digest.update((" ".join(entries) + "\n").encode())
+    return digest.hexdigest()
+
+def prune_mutations(db, cfg, nproc=1):
+    """Hash the optimized mutated module of mutations not pruned yet, and group all by hash
+
+       Returns the ids of mutations whose pruning changed, and of representatives
+       that got results of their duplicates."""
+    todo = db.execute("""SELECT mutation_id, mutation FROM mutations
+            WHERE mutation_id NOT IN (SELECT mutation_id FROM pruned) ORDER BY mutation_id""").fetchall()
+    changed = set()
+    if len(todo):
+        log_step(f"Optimizing {len(todo)} mutated modules.")
+        shutil.rmtree("database/prune", ignore_errors=True)
+        os.mkdir("database/prune")
+        module_of = {mid: re.search(r"-module (\S+)", mut_str).group(1) for mid, mut_str in todo}
+        modules = sorted(set(module_of.values()))
+
+        def write_module(f, module, filename):
+            # private names are renumbered, so equal netlists give equal files
+            print(f"opt -purge {module}", file=f)
+            print(f"rename -enumerate {module}", file=f)
+            print(f"select {module}", file=f)
+            print(f"write_rtlil -selected {filename}", file=f)
+            print("select -clear", file=f)
+
+        chunksize = (len(todo) + nproc - 1) // nproc
+        for idx in range(0, len(todo), chunksize):
+            with open(f"database/prune/prune_{idx}.ys", "w") as f:
+                print("read_rtlil database/design.il", file=f)
+                print("design -save mcy_orig", file=f)
+                if idx == 0:
+                    for k, module in enumerate(modules):
+                        write_module(f, module, f"database/prune/module_{k}.il")
+                for mid, mut_str in todo[idx:idx+chunksize]:
+                    print("design -load mcy_orig", file=f)
+                    print(mut_str, file=f)
+                    write_module(f, module_of[mid], f"database/prune/{mid}.il")
+            Task(f"yosys -ql database/prune/prune_{idx}.log database/prune/prune_{idx}.ys")
+            wait_tasks(nproc)
+        wait_tasks(1)
+
+        base = {module: struct_hash(f"database/prune/module_{k}.il") for k, module in enumerate(modules)}
+        for mid, _ in todo:
+            digest = struct_hash(f"database/prune/{mid}.il")
+            db.execute("INSERT INTO pruned (mutation_id, struct_hash, noop) VALUES (?, ?, ?)", [mid, digest, digest == base[module_of[mid]]])
+            os.remove(f"database/prune/{mid}.il")
+            changed.add(mid)
+        for k in range(len(modules)):
+            os.remove(f"database/prune/module_{k}.il")
+
+    log_step("Grouping duplicate mutations.")
+    heads = dict()
+    for mid, digest, representative in db.execute("SELECT mutation_id, struct_hash, representative FROM pruned ORDER BY mutation_id").fetchall():
+        head = heads.setdefault(digest, mid)
+        head = None if head == mid else head
+        if head != representative:
+            db.execute("UPDATE pruned SET representative = ? WHERE mutation_id = ?", [head, mid])
+            changed.add(mid)
+        # results a duplicate got before it was pruned are shared as well
+        if head is not None and db.execute("""INSERT INTO result_data (mutation_id, test_id, result_id)
+                SELECT ?, test_id, result_id FROM result_data WHERE mutation_id = ?
+                   AND test_id NOT IN (SELECT test_id FROM result_data WHERE mutation_id = ?)""", [head, mid, head]).rowcount:
+            changed.add(head)
+    return sorted(changed)
+
+# Cells whose inputs are always observable, cells whose ports are all
+# treated as observable, and output ports of the other internal cells
+OBSERVER_CELLS = {"$assert", "$assume", "$cover", "$live", "$fair", "$check", "$print"}
+OPAQUE_CELLS = {"$connect", "$memwr", "$memwr_v2", "$meminit", "$meminit_v2", "$overwrite_tag"}
+CELL_OUTPUTS = {"$memrd": {"\\DATA"}, "$memrd_v2": {"\\DATA"}}
+DEFAULT_CELL_OUTPUTS = {"\\Y", "\\Q", "\\X", "\\CO", "\\RD_DATA", "\\CTRL_OUT"}
+
+def parse_rtlil(filename):
+    """Read wires, ports, cells and connections of the modules in an RTLIL file
+
+       Signals are kept as lists of tokens. Modules with processes are marked opaque."""
+    modules = dict()
+    attributes = set()
+    module = cell = None
+    depth = 0
+    with open(filename, "r") as f:
+        for line in f:
+            tokens = line.split()
+            if len(tokens) == 0:
+                continue
+            if module is None:
+                if tokens[0] == "attribute":
+                    attributes.add(tokens[1])
+                elif tokens[0] == "module":
+                    module = types.SimpleNamespace(top="\\top" in attributes, blackbox="\\blackbox" in attributes or "\\whitebox" in attributes,
+                            opaque=False, wires=dict(), offsets=dict(), ports=dict(), cells=dict(), connects=list())
+                    modules[tokens[1]] = module
+                    attributes = set()
+            elif depth:
+                if tokens[0] in ("process", "switch"):
+                    depth += 1
+                elif tokens[0] == "end":
+                    depth -= 1
+            elif tokens[0] == "process":
+                module.opaque = True
+                depth = 1
+            elif tokens[0] == "wire":
+                module.wires[tokens[-1]] = int(tokens[tokens.index("width") + 1]) if "width" in tokens else 1
+                module.offsets[tokens[-1]] = (int(tokens[tokens.index("offset") + 1]) if "offset" in tokens else 0, "upto" in tokens)
+                for direction in ("input", "output", "inout"):
+                    if direction in tokens:
+                        module.ports[tokens[-1]] = direction
+            elif tokens[0] == "cell":
+                cell = types.SimpleNamespace(type=tokens[1], conns=dict())
+                module.cells[tokens[2]] = cell
+            elif tokens[0] == "connect":
+                if cell is not None:
+                    cell.conns[tokens[1]] = tokens[2:]
+                else:
+                    module.connects.append(tokens[1:])
+            elif tokens[0] == "end":
+                if cell is not None:
+                    cell = None
+                else:
+                    module = None
+    return modules
+
+def parse_sigspec(tokens, pos, module):
+    """Parse a signal of module starting at tokens[pos]
+
+       Returns the list of its bits (LSB first) as (wire, index) pairs,
+       None for constant bits, and the position after the signal. Raises
+       ValueError for slices it can not resolve."""
+    tok = tokens[pos]
+    pos += 1
+    offset, upto = 0, False
+    if tok == "{":
+        parts = list()
+        while tokens[pos] != "}":
+            part, pos = parse_sigspec(tokens, pos, module)
+            parts.append(part)
+        pos += 1
+        bits = [bit for part in reversed(parts) for bit in part]
+    elif re.match(r"^[0-9]+'", tok):
+        bits = [None] * int(tok.split("'")[0])
+    elif re.match(r"^-?[0-9]+$", tok):
+        bits = [None] * 32
+    elif tok[0] in "\\$":
+        bits = [(tok, idx) for idx in range(module.wires[tok])]
+        offset, upto = module.offsets[tok]
+    else:
+        raise ValueError(tok)
+    while pos < len(tokens) and tokens[pos].startswith("["):
+        match = re.match(r"^\[(-?[0-9]+)(?::(-?[0-9]+))?\]$", tokens[pos])
+        if match is None:
+            raise ValueError(tokens[pos])
+        # slices of a wire use its indices, which start at its offset and
+        # may count from the MSB
+        ends = [int(idx) - offset for idx in match.groups() if idx is not None]
+        if upto:
+            ends = [len(bits) - 1 - idx for idx in ends]
+        lo, hi = min(ends), max(ends)
+        if lo < 0 or hi >= len(bits):
+            raise ValueError(tokens[pos])
+        bits = bits[lo:hi+1]
+        offset, upto = 0, False
+        pos += 1
+    return bits, pos
+
+def cell_outputs(modules, cell):
+    """Output ports of a cell, None if all its ports count as observable"""
+    if cell.type in modules:
+        child = modules[cell.type]
+        if child.blackbox or "inout" in child.ports.values():
+            return None
+        return {port for port, direction in child.ports.items() if direction == "output"}
+    if cell.type in OBSERVER_CELLS:
+        return set()
+    if cell.type in OPAQUE_CELLS or not cell.type.startswith("$"):
+        return None
+    return CELL_OUTPUTS.get(cell.type, DEFAULT_CELL_OUTPUTS)
+
+def module_cone(modules, name, observed, sinks):
+    """Find the bits of a module in the fan-in cone of its observed output bits
+
+       Any input of a cell is taken to reach all of its outputs. The input
+       bits in sinks of an instantiated module are observed within it, e.g.
+       by an assertion. Adds the observed output bits of instantiated modules
+       to observed. Returns None if the module can not be analyzed."""
+    module = modules[name]
+    try:
+        if module.opaque:
+            raise ValueError(name)
+        parent = dict()
+        def find(bit):
+            while parent.get(bit, bit) != bit:
+                parent[bit] = parent.get(parent[bit], parent[bit])
+                bit = parent[bit]
+            return bit
+        for tokens in module.connects:
+            lhs, pos = parse_sigspec(tokens, 0, module)
+            rhs, _ = parse_sigspec(tokens, pos, module)
+            for a, b in zip(lhs, rhs):
+                if a is not None and b is not None and find(a) != find(b):
+                    parent[find(a)] = find(b)
+        conns = {cname: {port: parse_sigspec(tokens, 0, module)[0] for port, tokens in cell.conns.items()}
+                for cname, cell in module.cells.items()}
+    except (ValueError, KeyError, IndexError, AttributeError):
+        # everything instantiated here counts as observed
+        for cell in module.cells.values():
+            if cell.type in modules:
+                observed[cell.type] |= {(port, idx) for port in modules[cell.type].ports for idx in range(modules[cell.type].wires[port])}
+        return None
+
+    observable, active, pending = set(), set(), list()
+    def observe(bits):
+        for bit in bits:
+            if bit is not None and find(bit) not in observable:
+                observable.add(find(bit))
+                pending.append(find(bit))
+    def activate(cname):
+        active.add(cname)
+        outputs = cell_outputs(modules, module.cells[cname])
+        for port, bits in conns[cname].items():
+            if outputs is None or port not in outputs:
+                observe(bits)
+
+    drivers = dict()
+    for cname, cell in module.cells.items():
+        outputs = cell_outputs(modules, cell)
+        if outputs is None or cell.type in OBSERVER_CELLS:
+            activate(cname)
+            continue
+        for port in outputs:
+            for bit in conns[cname].get(port, ()):
+                if bit is not None:
+                    drivers.setdefault(find(bit), list()).append(cname)
+    observe(observed[name])
+    observe((port, idx) for port, direction in module.ports.items() if direction == "inout" for idx in range(module.wires[port]))
+    for cname, cell in module.cells.items():
+        if cell.type in modules:
+            for port, bits in conns[cname].items():
+                observe(bit for idx, bit in enumerate(bits) if (port, idx) in sinks[cell.type])
+    while len(pending):
+        for cname in drivers.get(pending.pop(), ()):
+            if cname not in active:
+                activate(cname)
+
+    for cname, cell in module.cells.items():
+        if cell.type in modules:
+            for port, bits in conns[cname].items():
+                if modules[cell.type].ports.get(port) in ("output", "inout"):
+                    observed[cell.type] |= {(port, idx) for idx, bit in enumerate(bits) if bit is not None and find(bit) in observable}
+    return types.SimpleNamespace(find=find, observable=observable, active=active, conns=conns)
+
+def observable_mutations(mutations):
+    """Mutations whose mutated signal may reach an output of a top module or an assertion
+
+       mutations is a list of (mutation_id, mutation) pairs. Returns the set
+       of observable mutation ids. Anything the analysis of database/design.il
+       does not understand is taken to be observable."""
+    modules = parse_rtlil("database/design.il")
+    parents = {name: set() for name in modules}
+    children = {name: set() for name in modules}
+    for name, module in modules.items():
+        for cell in module.cells.values():
+            if cell.type in modules:
+                parents[cell.type].add(name)
+                children[name].add(cell.type)
+
+    # input bits reaching an assertion or opaque cell of the module or its
+    # submodules, modules are analyzed after all modules they instantiate
+    sinks = dict()
+    while True:
+        ready = sorted(name for name in modules if name not in sinks and children[name] <= sinks.keys())
+        if len(ready) == 0:
+            break
+        for name in ready:
+            cone = module_cone(modules, name, {m: set() for m in modules}, sinks)
+            sinks[name] = {(port, idx) for port, direction in modules[name].ports.items() if direction == "input"
+                    for idx in range(modules[name].wires[port]) if cone is None or cone.find((port, idx)) in cone.observable}
+    for name, module in modules.items():
+        if name not in sinks:
+            sinks[name] = {(port, idx) for port in module.ports for idx in range(module.wires[port])}
+    tops = [name for name, module in modules.items() if module.top] or [name for name in modules if len(parents[name]) == 0]
+    observed = {name: set() for name in modules}
+    for name in tops:
+        observed[name] |= {(port, idx) for port, direction in modules[name].ports.items() if direction != "input"
+                for idx in range(modules[name].wires[port])}
+
+    # modules are analyzed after all modules instantiating them
+    cones = dict()
+    while True:
+        ready = sorted(name for name in modules if name not in cones and parents[name] <= cones.keys())
+        if len(ready) == 0:
+            break
+        for name in ready:
+            cones[name] = module_cone(modules, name, observed, sinks)
+
+    result = set()
+    for mid, mut_str in mutations:
+        options = dict(mutation_options(mut_str))
+        cone = cones.get(options.get("module"))
+        cname, port = options.get("cell"), options.get("port")
+        try:
+            outputs = cell_outputs(modules, modules[options["module"]].cells[cname])
+            if outputs is None:
+                result.add(mid)
+            elif port in outputs:
+                bit = cone.conns[cname][port][int(options.get("portbit", 0))]
+                if bit is not None and cone.find(bit) in cone.observable:
+                    result.add(mid)
+            elif cname in cone.active:
+                result.add(mid)
+        except (KeyError, IndexError, AttributeError, ValueError):
+            result.add(mid)
+    return result
+
+def check_observability(db, cfg):
+    """Analyze the observability of mutations not analyzed yet, if enabled"""
+    if not observability_enabled(cfg):
+        return
+    todo = db.execute("""SELECT mutation_id, mutation FROM mutations
+            WHERE mutation_id NOT IN (SELECT mutation_id FROM observable) ORDER BY mutation_id""").fetchall()
+    if len(todo):
+        log_step(f"Checking observability of {len(todo)} mutations.")
+        observable = observable_mutations(todo)
+        db.executemany("INSERT INTO observable (mutation_id, observable) VALUES (?, ?)", ((mid, mid in observable) for mid, _ in todo))
+
+def reset_status(db, cfg, do_reset=False, nproc=None):
+    """Reset status
+
+       With do_reset, up to nproc processes (default: all cores) create
+       missing mutations and evaluate [logic]."""
+    nproc = os.cpu_count() if nproc is None else nproc
     if do_reset:
         nmutations, = db.execute("SELECT COUNT(*) FROM mutations").fetchone()
         if nmutations < cfg.opt_size:
             log_step(f"Adding {(cfg.opt_size - nmutations)} mutations to database.")
 
-            log_step("Creating additional mutations script file.")
-            with open("database/mutations2.ys", "w") as f:
-                print("read_rtlil database/design.il", file=f)
-                print(f"mutate -list {cfg.opt_size} -seed {cfg.opt_seed} -none{''.join(' -cfg %s %d' % (k, v) for k, v, in sorted(cfg.mutopts.items()))}{' -mode ' + cfg.opt_mode if cfg.opt_mode else ''} -o database/mutations2.txt -s database/sources.txt{' ' + ' '.join(cfg.select) if len(cfg.select) else ''}", file=f)
-
-            log_step("Creating additional mutations.")
-            task = Task("yosys -ql database/mutations2.log database/mutations2.ys")
-            task.wait()
+            generate_mutations(cfg, "mutations2", cfg.opt_size, nproc)
 
             log_step("Inserting additional mutations in database.")
             with open("database/mutations2.txt", "r") as f_in:
                 with open("database/mutations.txt", "a") as f_out:
-                    for line in f_in:
-                        if not db.execute("SELECT COUNT(*) FROM mutations WHERE mutation = ?", [line.rstrip()]).fetchone()[0]:
-                            mid = db.execute("INSERT INTO mutations (mutation) VALUES (?)", [line.rstrip()]).lastrowid
-                            print(line.rstrip(), file=f_out)
-                            optarray = line.split()
-                            skip_next = False
-                            for i in range(len(optarray)-1):
-                                if skip_next:
-                                    skip_next = False
-                                elif optarray[i].startswith("-"):
-                                    db.execute("INSERT INTO options (mutation_id, opt_type, opt_value) VALUES (?, ?, ?)", [mid, optarray[i][1:], optarray[i+1]])
-                                    skip_next = True
-                            nmutations += 1
-                            if nmutations == cfg.opt_size:
-                                break
+                    nmutations += import_mutations(db, f_in, cfg.opt_size - nmutations, f_out)
+            db.commit()
+
+        check_observability(db, cfg)
 
         log_step("Remove 'tasks' subdirectory.")
         shutil.rmtree("tasks", ignore_errors=True)
 
         log_step("Update mutations.")
-        for mid, in db.execute("SELECT mutation_id FROM mutations"):
-            update_mutation(db, cfg, mid)
+        # Mutations whose results and [logic] are unchanged since they were
+        # last updated keep their tags and queue entries. Queued ones are
+        # updated anyway if the cache might have a result for them now.
+        states = load_mutation_state(db)
+        nmutations = len(states)
+        for mid, state in list(states.items()):
+            if state.logic_hash is not None and not (cfg.opt_cache is not None and len(state.queue)) and \
+                    state.logic_hash == logic_hash(cfg, [(test_id, result_id) for test_id, result_id, _, _ in state.results], state):
+                del states[mid]
+        unchanged = nmutations - len(states)
+        # Large sets are evaluated by worker processes, this process
+        # applies the changed tags and queue entries in one transaction.
+        if nproc > 1 and len(states) >= 2 * LOGIC_BATCH:
+            for mid, tags, queued in eval_logic_parallel(cfg, states, nproc):
+                update_mutation(db, cfg, mid, states[mid], (tags, queued))
+        else:
+            for mid, state in states.items():
+                update_mutation(db, cfg, mid, state)
+        share_results(db, cfg)
+        commit_results(db, force=True)
+        if unchanged:
+            log_step(f"Skipped {unchanged} unchanged mutations.")
+        if CACHE is not None:
+            print(f"Reused {CACHE.hits} results from cache '{cfg.opt_cache}'.")
 
     log_step("Getting database statistics.")
-    cnt, = db.execute("SELECT COUNT(*) FROM results").fetchone()
+    cnt, = db.execute("SELECT COUNT(*) FROM result_data").fetchone()
     print(f"Database contains {cnt} cached results.")
 
-    for tst, res, cnt in db.execute("SELECT test, result, COUNT(*) FROM results GROUP BY test, result"):
+    for tst, res, cnt in db.execute("""SELECT test, result, cnt FROM
+            (SELECT test_id, result_id, COUNT(*) AS cnt FROM result_data GROUP BY test_id, result_id)
+            JOIN tests USING (test_id) JOIN result_values USING (result_id) ORDER BY test, result"""):
         print(f"Database contains {cnt} cached \"{res}\" results for \"{tst}\".")
 
-    for tag, cnt in db.execute("SELECT tag, COUNT(*) FROM tags GROUP BY tag"):
+    cnt, = db.execute("SELECT COUNT(*) FROM observable WHERE NOT observable").fetchone()
+    if cnt:
+        print(f"Found {cnt} unobservable mutations.")
+
+    noops, duplicates = db.execute("SELECT IFNULL(SUM(noop), 0), COUNT(representative) FROM pruned").fetchone()
+    if noops or duplicates:
+        print(f"Pruning found {noops} no-op and {duplicates} duplicate mutations.")
+
+    for tag, cnt in db.execute("""SELECT tag, cnt FROM (SELECT tag_id, COUNT(*) AS cnt FROM tag_data GROUP BY tag_id)
+            JOIN tag_names USING (tag_id) ORDER BY tag"""):
         print(f"Tagged {cnt} mutations as \"{tag}\".")
 
-    for tst, cnt, rn in db.execute("SELECT test, COUNT(*), SUM(running) FROM queue GROUP BY test"):
+    for tst, cnt, rn in db.execute("""SELECT test, cnt, rn FROM
+            (SELECT test_id, COUNT(*) AS cnt, SUM(IFNULL(lease_expiry, 0) >= ?) AS rn FROM queue_data GROUP BY test_id)
+            JOIN tests USING (test_id) ORDER BY test""", [time.time()]):
         if rn > 0:
             print(f"Queued {cnt} \"{tst}\" tests, {rn} running.")
         else:
@@ -336,7 +1666,7 @@ def print_report(db, cfg):
     """Print report"""
     def env_tags(tag=None):
         if tag is None:
-            cnt, = db.execute("SELECT COUNT(DISTINCT mutation_id) FROM tags").fetchone()
+            cnt, = db.execute("SELECT COUNT(DISTINCT mutation_id) FROM tag_data").fetchone()
             return cnt
 
         invert = False
@@ -344,59 +1674,477 @@ def print_report(db, cfg):
             invert = True
             tag = tag[1:]
 
-        cnt, = db.execute("SELECT COUNT(*) FROM tags WHERE tag = ?", [tag]).fetchone()
+        cnt, = db.execute("SELECT COUNT(*) FROM tag_data WHERE tag_id = (SELECT tag_id FROM tag_names WHERE tag = ?)", [tag]).fetchone()
 
         if invert:
             return env_tags() - cnt
         return cnt
 
     log_step("Print report")
-    gdict = globals().copy()
-    gdict["tags"] = env_tags
-
-    code = "def __report__():\n  " + "\n  ".join(cfg.report) + "\n__report__()\n"
-    exec(code, gdict)
+    report, env = compile_section(cfg, "report")
+    env["tags"] = env_tags
+    report()
 
 ######################################################
 
-def wait_tasks(num):
-    """Wait for tasks"""
-    global TASKDB
+def test_stats(tst):
+    """Return runtime statistics for a test invocation"""
+    if tst not in TESTSTATS:
+        TESTSTATS[tst] = types.SimpleNamespace(samples=list(), results=0, final=0, counts=dict())
+    return TESTSTATS[tst]
+
+def record_runtime(tst, batchsize, runtime, cputime):
+    """Record wall and CPU time of a finished task"""
+    stats = test_stats(tst)
+    stats.samples.append((batchsize, runtime, runtime if cputime is None else cputime))
+    del stats.samples[:-50]
+
+def record_execution(db, task, tst, batch, start_time, end_time, exit_code, cputime, peakmemory, host, limit_hit):
+    """Append a finished task to the execution history"""
+    db.execute("INSERT OR IGNORE INTO tests (test) VALUES (?)", [tst])
+    db.execute("""INSERT INTO executions (task, test_id, batch, start_time, end_time, exit_code, cputime, peakmemory, host, limit_hit)
+            VALUES (?, (SELECT test_id FROM tests WHERE test = ?), ?, ?, ?, ?, ?, ?, ?, ?)""",
+            [task, tst, batch, start_time, end_time, exit_code, cputime, peakmemory, host, limit_hit])
+
+def record_task(db, tst, task):
+    """Append a finished local task to the execution history"""
+    record_execution(db, task.task_id, tst, task.batch, task.starttime, task.endtime, task.p.returncode,
+            task.cputime(), task.peakmemory, socket.gethostname(), task.limit_hit)
+
+def load_executions(db):
+    """Initialize runtime samples of all tests from the execution history"""
+    for tst, batch, runtime, cputime in db.execute("""SELECT test, batch, runtime, cputime FROM
+            (SELECT test_id, batch, end_time, end_time - start_time AS runtime, cputime,
+                    ROW_NUMBER() OVER (PARTITION BY test_id ORDER BY end_time DESC) AS age
+               FROM executions WHERE limit_hit IS NULL)
+            JOIN tests USING (test_id) WHERE age <= 50 ORDER BY end_time"""):
+        record_runtime(tst, batch, runtime, cputime)
+
+def print_executions(db):
+    """Print a runtime summary per test from the execution history"""
+    for tst, cnt, muts, runtime, cputime, peakmemory, limits in db.execute("""SELECT test, cnt, muts, runtime, cputime, peakmemory, limits FROM
+            (SELECT test_id, COUNT(*) AS cnt, SUM(batch) AS muts, SUM(end_time - start_time) AS runtime,
+                    SUM(cputime) AS cputime, MAX(peakmemory) AS peakmemory, COUNT(limit_hit) AS limits
+               FROM executions GROUP BY test_id)
+            JOIN tests USING (test_id) ORDER BY test"""):
+        summary = f"Ran {cnt} \"{tst}\" tasks on {muts} mutations: {runtime / cnt:.2f}s per task, {runtime / max(muts, 1):.2f}s per mutation"
+        if cputime is not None:
+            summary += f", {cputime:.2f}s CPU time in total"
+        if peakmemory is not None:
+            summary += f", {peakmemory // 1024} kB peak memory"
+        if limits:
+            summary += f", {limits} over limit"
+        print(summary + ".")
+
+def record_outcome(tst, res, final):
+    """Record a result and whether it completed the logic of a mutation"""
+    stats = test_stats(tst)
+    stats.results += 1
+    stats.counts[res] = stats.counts.get(res, 0) + 1
+    if final:
+        stats.final += 1
+
+def likely_result(tst):
+    """Most frequent result of a test so far, None if it never ran"""
+    counts = test_stats(tst).counts
+    if len(counts) == 0:
+        return None
+    return max(counts, key=lambda res: counts[res])
+
+def estimate_runtime(tst):
+    """Estimate (setup, per-mutation) wall time of a test by a least squares fit"""
+    samples = test_stats(tst).samples
+    if len(set(b for b, _, _ in samples)) < 2:
+        return None
+    n = len(samples)
+    mean_b = sum(b for b, _, _ in samples) / n
+    mean_t = sum(t for _, t, _ in samples) / n
+    var_b = sum((b - mean_b) ** 2 for b, _, _ in samples)
+    permut = sum((b - mean_b) * (t - mean_t) for b, t, _ in samples) / var_b
+    permut = max(permut, 1e-3)
+    setup = max(mean_t - permut * mean_b, 0.0)
+    return setup, permut
+
+def expected_cost(tst, cpu=False):
+    """Average wall (or CPU) time per mutation of a test, 0 if never run"""
+    samples = test_stats(tst).samples
+    if len(samples) == 0:
+        return 0.0
+    return sum(c if cpu else t for _, t, c in samples) / sum(b for b, _, _ in samples)
+
+def policy_largest(candidates):
+    """Test with the most pending mutations"""
+    return max(candidates, key=lambda c: c.count)
+
+def policy_fifo(candidates):
+    """Test queued first"""
+    return min(candidates, key=lambda c: c.first)
+
+def policy_sef(candidates):
+    """Test with the shortest expected runtime per mutation"""
+    return min(candidates, key=lambda c: (expected_cost(c.test), -c.count))
+
+def policy_gain(candidates):
+    """Test completing the most mutations per CPU second"""
+    def gain(c):
+        stats = test_stats(c.test)
+        # Laplace estimate of the chance that the result completes the [logic]
+        # of a mutation instead of queueing another test for it
+        pfinal = (stats.final + 1) / (stats.results + 2)
+        return pfinal / max(expected_cost(c.test, cpu=True), 1e-3)
+    return max(candidates, key=lambda c: (gain(c), c.count))
+
+POLICIES = {
+    "largest": policy_largest,
+    "fifo": policy_fifo,
+    "sef": policy_sef,
+    "gain": policy_gain,
+}
+
+def auto_batchsize(cfg, tst, npending, nproc):
+    """Pick the batch size minimizing the makespan of the pending tasks for a test"""
+    t = tst.split()[0]
+    if cfg.tests[t].autobatch is None:
+        return cfg.tests[t].maxbatchsize
+    limit = max(1, min(cfg.tests[t].autobatch, npending))
+    estimate = estimate_runtime(tst)
+    if estimate is None:
+        # Probe with two different batch sizes before a fit is possible
+        samples = test_stats(tst).samples
+        if len(samples) == 0 or samples[-1][0] != 1:
+            return 1
+        return min(8, limit, -(-npending // nproc))
+    setup, permut = estimate
+    best, best_makespan = 1, None
+    for size in range(1, limit + 1):
+        ntasks = -(-npending // size)
+        rounds = -(-ntasks // nproc)
+        makespan = rounds * (setup + size * permut)
+        if best_makespan is None or makespan <= best_makespan:
+            best, best_makespan = size, makespan
+    return best
+
+def init_events():
+    """Set up event selector woken on child exit"""
+    global EVENTS
+    if EVENTS is not None or os.name != "posix":
+        return
+    EVENTS = selectors.DefaultSelector()
+    rfd, wfd = os.pipe()
+    os.set_blocking(rfd, False)
+    os.set_blocking(wfd, False)
+    # Python writes to the wakeup fd whenever a signal arrives, so a SIGCHLD
+    # delivered before select() is entered can not get lost.
+    signal.signal(signal.SIGCHLD, lambda signum, frame: None)
+    signal.set_wakeup_fd(wfd)
+    EVENTS.register(rfd, selectors.EVENT_READ, lambda fd: os.read(fd, 4096))
+
+def wait_events(timeout=None):
+    """Block until an event (e.g. a child exiting) is pending"""
+    if EVENTS is None:
+        time.sleep(0.5 if timeout is None else min(0.5, timeout))
+        return
+    for key, _ in EVENTS.select(timeout):
+        key.data(key.fileobj)
+
+def poll_timeout(timeout=None):
+    """Time until running tasks have to be polled next (limits, lease renewal, commits)"""
+    now = time.time()
+    if LEASE is not None and LEASE.db.in_transaction:
+        remaining = max(0, LASTCOMMIT + COMMIT_INTERVAL - now)
+        timeout = remaining if timeout is None else min(timeout, remaining)
+    if LEASE is not None and len(RUNNING):
+        remaining = max(0, LEASE.renewed + LEASE_TIME / 4 - now)
+        timeout = remaining if timeout is None else min(timeout, remaining)
+    for task in TASKDB.values():
+        if "timeout" in task.limits:
+            remaining = max(0, task.starttime + task.limits["timeout"][0] - now)
+            timeout = remaining if timeout is None else min(timeout, remaining)
+        if "cpulimit" in task.limits and task.cgroup is not None:
+            timeout = 1.0 if timeout is None else min(timeout, 1.0)
+    return timeout
+
+def poll_tasks():
+    """Enforce limits of running tasks, poll them and renew their leases"""
+    now = time.time()
     for task in list(TASKDB.values()):
+        task.check_limits(now)
         task.poll()
+    if LEASE is not None:
+        commit_results(LEASE.db)
+    renew_leases()
 
-    while len(TASKDB) >= num:
-        time.sleep(0.5)  # Ugh!
-        for task in list(TASKDB.values()):
-            task.poll()
+def wait_tasks(num):
+    """Wait for tasks until less than num cores are in use"""
+    init_events()
+    poll_tasks()
+
+    while sum(task.cores for task in TASKDB.values()) >= num:
+        wait_events(poll_timeout())
+        poll_tasks()
+
+def wait_progress():
+    """Wait until a task finishes or reports a result"""
+    init_events()
+    wait_events(poll_timeout())
+    poll_tasks()
+
+def default_budget(nproc, memory=None):
+    """Cores and memory (bytes, 0 for unlimited) available to tasks"""
+    if memory is None:
+        try:
+            memory = os.sysconf("SC_PAGE_SIZE") * os.sysconf("SC_PHYS_PAGES")
+        except (ValueError, OSError, AttributeError):
+            memory = 0
+    return types.SimpleNamespace(cores=nproc, memory=memory)
+
+def task_resources(cfg, tst, budget):
+    """Cores and memory reserved by a task for a test, clamped to the budget"""
+    test = cfg.tests[tst.split()[0]]
+    cores = budget.cores if test.exclusive else min(test.cores, budget.cores)
+    memory = min(test.memory, budget.memory) if budget.memory else test.memory
+    return cores, memory
+
+def free_resources(budget):
+    """Cores and memory of the budget not reserved by running tasks"""
+    return types.SimpleNamespace(
+        cores=budget.cores - sum(task.cores for task in TASKDB.values()),
+        memory=budget.memory - sum(task.memory for task in TASKDB.values()) if budget.memory else 0,
+        idle=len(TASKDB) == 0)
+
+def init_cgroup():
+    """Set up a delegated cgroup v2 subtree for task limits, False if unavailable
+
+       The memory controller is only enabled for the children of the parent
+       group if it was not already, and disabled again by cleanup_cgroup."""
+    global CGROUP, CGROUP_MAIN
+    if CGROUP is not None:
+        return CGROUP
+    CGROUP = False
+    if os.name != "posix" or not os.path.exists("/proc/self/cgroup"):
+        return CGROUP
+    with open("/proc/self/cgroup") as f:
+        paths = [line.rstrip("\n")[3:] for line in f if line.startswith("0::")]
+    if len(paths) != 1 or not os.path.exists("/sys/fs/cgroup%s/cgroup.controllers" % paths[0]):
+        return CGROUP
+    base = "/sys/fs/cgroup" + paths[0].rstrip("/")
+    # Controllers can only be enabled for child groups of a group without
+    # processes, so MCY moves itself into a leaf group first.
+    main = "%s/mcy-%d" % (base, os.getpid())
+    try:
+        with open(base + "/cgroup.subtree_control") as f:
+            enabled = "memory" not in f.read().split()
+        os.mkdir(main)
+        CGROUP_MAIN = types.SimpleNamespace(path=main, enabled=False)
+        with open(main + "/cgroup.procs", "w") as f:
+            f.write(str(os.getpid()))
+        if enabled:
+            with open(base + "/cgroup.subtree_control", "w") as f:
+                f.write("+memory")
+            CGROUP_MAIN.enabled = True
+        CGROUP = base
+    except OSError:
+        try:
+            with open(base + "/cgroup.procs", "w") as f:
+                f.write(str(os.getpid()))
+            os.rmdir(main)
+        except OSError:
+            pass
+        CGROUP_MAIN = None
+    return CGROUP
+
+def cleanup_cgroup():
+    """Undo the changes of init_cgroup, after all tasks were terminated"""
+    global CGROUP_MAIN
+    if CGROUP_MAIN is None:
+        return
+    base = os.path.dirname(CGROUP_MAIN.path)
+    try:
+        for path in os.listdir(base):
+            if path.startswith("mcy-%d-task" % os.getpid()):
+                os.rmdir(os.path.join(base, path))
+        if CGROUP_MAIN.enabled:
+            with open(base + "/cgroup.subtree_control", "w") as f:
+                f.write("-memory")
+        with open(base + "/cgroup.procs", "w") as f:
+            f.write(str(os.getpid()))
+        os.rmdir(CGROUP_MAIN.path)
+    except OSError:
+        pass
+    CGROUP_MAIN = None
+
+def make_cgroup(taskidx, limits):
+    """Create the cgroup for a task with limits, None if cgroups are unavailable"""
+    if not init_cgroup():
+        return None
+    path = "%s/mcy-%d-task%d" % (CGROUP, os.getpid(), taskidx)
+    try:
+        os.mkdir(path)
+        if "memlimit" in limits:
+            with open(path + "/memory.max", "w") as f:
+                f.write(str(int(limits["memlimit"][0])))
+            # kill the whole task on OOM instead of leaving the script running
+            with open(path + "/memory.oom.group", "w") as f:
+                f.write("1")
+            if os.path.exists(path + "/memory.swap.max"):
+                with open(path + "/memory.swap.max", "w") as f:
+                    f.write("0")
+    except OSError:
+        return None
+    return path
+
+def read_cgroup_stat(path, filename, key=None):
+    """Read a value from a cgroup file, None if unavailable"""
+    try:
+        with open("%s/%s" % (path, filename)) as f:
+            for line in f:
+                entries = line.split()
+                if key is None:
+                    return int(entries[0])
+                if len(entries) == 2 and entries[0] == key:
+                    return int(entries[1])
+    except (OSError, ValueError, IndexError):
+        pass
+    return None
+
+def limit_child(cgroup, limits):
+    """Apply limits in the forked child before running the task command"""
+    if cgroup is not None:
+        with open(cgroup + "/cgroup.procs", "w") as f:
+            f.write("0")
+        return
+    import resource
+    if "memlimit" in limits:
+        memlimit = int(limits["memlimit"][0])
+        resource.setrlimit(resource.RLIMIT_AS, (memlimit, memlimit))
+    if "cpulimit" in limits:
+        cpulimit = int(limits["cpulimit"][0] + 0.999)
+        resource.setrlimit(resource.RLIMIT_CPU, (cpulimit, cpulimit + 1))
 
 class Task:
     """Task class"""
-    def __init__(self, command, callback=None, silent=False, logfilename=None):
+    def __init__(self, command, callback=None, silent=False, logfilename=None, cores=1, memory=0, limits=None):
         """constructor"""
         global TASKIDX
         TASKIDX += 1
         self.taskidx = TASKIDX
         self.command = command
+        self.cores = cores
+        self.memory = memory
+        self.limits = limits if limits is not None else dict()
+        self.limit_hit = None
+        self.cgroup = None
         if not silent:
             print(command)
         self.callback = callback
         self.logfilename = logfilename
-        self.p = subprocess.Popen(command, shell=True, stdin=subprocess.DEVNULL)
+        self.rusage = None
+        self.cpuused = None
+        self.peakmemory = None
+        self.starttime = time.time()
+        self.endtime = None
+        # Tasks with limits run in their own process group (and cgroup, if
+        # available), so everything started by the test script can be killed.
+        options = dict()
+        if len(self.limits) and os.name == "posix":
+            self.cgroup = make_cgroup(self.taskidx, self.limits)
+            options["start_new_session"] = True
+            if self.cgroup is not None or "memlimit" in self.limits or "cpulimit" in self.limits:
+                options["preexec_fn"] = lambda: limit_child(self.cgroup, self.limits)
+        self.p = subprocess.Popen(command, shell=True, stdin=subprocess.DEVNULL, **options)
         TASKDB[TASKIDX] = self
         self.running = True
 
-    def poll(self):
+    def reap(self, block):
+        """Reap the child process, collecting its resource usage"""
+        if os.name != "posix":
+            return_code = self.p.wait() if block else self.p.poll()
+        else:
+            pid, status, self.rusage = os.wait4(self.p.pid, 0 if block else os.WNOHANG)
+            if pid == 0:
+                return None
+            return_code = -os.WTERMSIG(status) if os.WIFSIGNALED(status) else os.WEXITSTATUS(status)
+            self.p.returncode = return_code
+        if return_code is not None:
+            self.endtime = time.time()
+            self.collect_usage(return_code)
+        return return_code
+
+    def collect_usage(self, return_code):
+        """Record CPU time and peak memory, and find limits hit by the finished task"""
+        if self.rusage is not None:
+            self.cpuused = self.rusage.ru_utime + self.rusage.ru_stime
+        # ru_maxrss would include the memory of mcy itself before the exec, so
+        # peak memory is only known from the task's cgroup.
+        if self.cgroup is not None:
+            usage = read_cgroup_stat(self.cgroup, "cpu.stat", "usage_usec")
+            if usage is not None:
+                self.cpuused = usage / 1000000
+            peak = read_cgroup_stat(self.cgroup, "memory.peak")
+            if peak is not None:
+                self.peakmemory = peak
+            if self.limit_hit is None and "memlimit" in self.limits and \
+                    (read_cgroup_stat(self.cgroup, "memory.events", "oom_kill") or 0) > 0:
+                self.limit_hit = "memlimit"
+            try:
+                os.rmdir(self.cgroup)
+            except OSError:
+                pass
+        elif self.limit_hit is None and return_code != 0:
+            # With rlimits, an exceeded limit can only be guessed from the exit status.
+            if "cpulimit" in self.limits and (return_code in (-signal.SIGXCPU, 128 + signal.SIGXCPU) or
+                    (self.cpuused or 0) >= self.limits["cpulimit"][0]):
+                self.limit_hit = "cpulimit"
+            # A failed allocation usually ends in one of these signals, other
+            # failures are still reported as errors.
+            elif "memlimit" in self.limits and return_code in [code for signum in (signal.SIGKILL, signal.SIGSEGV, signal.SIGABRT)
+                    for code in (-signum, 128 + signum)]:
+                self.limit_hit = "memlimit"
+
+    def cputime(self):
+        """CPU time used by the task, None if unknown"""
+        return self.cpuused
+
+    def signal_group(self, signum):
+        """Send a signal to all processes started by the task"""
+        if self.cgroup is not None and signum == signal.SIGKILL:
+            try:
+                with open(self.cgroup + "/cgroup.kill", "w") as f:
+                    f.write("1")
+            except OSError:
+                pass
+        try:
+            os.killpg(self.p.pid, signum)
+        except OSError:
+            pass
+
+    def check_limits(self, now):
+        """Kill the task if it exceeded its wall time or CPU time limit"""
+        if not self.running or self.limit_hit is not None:
+            return
+        if "timeout" in self.limits and now - self.starttime >= self.limits["timeout"][0]:
+            self.limit_hit = "timeout"
+        elif "cpulimit" in self.limits and self.cgroup is not None and \
+                (read_cgroup_stat(self.cgroup, "cpu.stat", "usage_usec") or 0) >= self.limits["cpulimit"][0] * 1000000:
+            self.limit_hit = "cpulimit"
+        else:
+            return
+        if os.name == "posix":
+            self.signal_group(signal.SIGKILL)
+        else:
+            self.p.kill()
+
+    def poll(self, block=False):
         """poll"""
         if not self.running:
             return True
-        return_code = self.p.poll()
+        return_code = self.reap(block)
         if return_code is None:
             return False
         self.running = False
         if self.taskidx in TASKDB:
             del TASKDB[self.taskidx]
-        if return_code != 0:
+        if return_code != 0 and self.limit_hit is None:
             log_error_additional(f"Command '{self.command}' returned non-zero return code {return_code}.",
                 f"See '{self.logfilename}' for details." if self.logfilename is not None else ""
             )
@@ -407,8 +2155,7 @@ class Task:
 
     def wait(self):
         """wait"""
-        self.p.wait()
-        self.poll()
+        self.poll(block=True)
 
     def term(self):
         """term"""
@@ -416,6 +2163,16 @@ class Task:
             if TASKDB is not None:
                 del TASKDB[self.taskidx]
             self.running = False
+            if len(self.limits) and os.name == "posix":
+                self.signal_group(signal.SIGTERM)
+                self.p.wait(2)
+                self.signal_group(signal.SIGKILL)
+                if self.cgroup is not None:
+                    try:
+                        os.rmdir(self.cgroup)
+                    except OSError:
+                        pass
+                return
             self.p.terminate()
             self.p.wait(2)
             self.p.kill()
@@ -424,6 +2181,41 @@ class Task:
         """destructor"""
         self.term()
 
+class ResultStream:
+    """Named pipe in place of a task's output.txt, read while the task runs"""
+    def __init__(self, path, callback):
+        """constructor"""
+        os.mkfifo(path)
+        self.rfd = os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+        # Hold a write end ourselves, so the pipe never signals EOF when the
+        # test script closes it between two results.
+        self.wfd = os.open(path, os.O_WRONLY | os.O_NONBLOCK)
+        self.callback = callback
+        self.buffer = b""
+        EVENTS.register(self.rfd, selectors.EVENT_READ, self.read)
+
+    def read(self, fd=None):
+        """Pass all complete lines read so far to the callback"""
+        while True:
+            try:
+                data = os.read(self.rfd, 65536)
+            except BlockingIOError:
+                break
+            self.buffer += data
+            *lines, self.buffer = self.buffer.split(b"\n")
+            for line in lines:
+                self.callback(line.decode())
+
+    def close(self):
+        """Read remaining data and close the pipe"""
+        self.read()
+        EVENTS.unregister(self.rfd)
+        os.close(self.wfd)
+        os.close(self.rfd)
+        if self.buffer.strip():
+            self.callback(self.buffer.decode())
+        self.buffer = b""
+
 ######################################################
 
 @click.group(context_settings=dict(help_option_names=["-h", "--help"]), invoke_without_command=True)
@@ -437,8 +2229,10 @@ def cli(ctx):
 @cli.command(name='init')
 @click.option('-f', '--force', help='Force database initialization.', is_flag=True)
 @click.option('--nosetup', help='Do not setup project.', is_flag=True)
+@click.option('--prune', help='Find no-op and duplicate mutations (see mcy prune).', is_flag=True)
+@click.option('-j', '--nproc', default=1, show_default=True, help='Number of yosys processes creating and pruning mutations.')
 @click.option('--trace', help='Trace database operations.', is_flag=True)
-def init_command(force, nosetup, trace):
+def init_command(force, nosetup, prune, nproc, trace):
     """Initialize database"""
     global DBTRACE
     DBTRACE = trace
@@ -479,14 +2273,7 @@ def init_command(force, nosetup, trace):
     task = Task("yosys -ql database/design.log database/design.ys")
     task.wait()
 
-    log_step("Creating mutations script file.")
-    with open("database/mutations.ys", "w") as f:
-        print("read_rtlil database/design.il", file=f)
-        print(f"mutate -list {cfg.opt_size} -seed {cfg.opt_seed} -none{''.join(' -cfg %s %d' % (k, v) for k, v, in sorted(cfg.mutopts.items()))}{' -mode ' + cfg.opt_mode if cfg.opt_mode else ''} -o database/mutations.txt -s database/sources.txt{' ' + ' '.join(cfg.select) if len(cfg.select) else ''}", file=f)
-
-    log_step("Creating mutations.")
-    task = Task("yosys -ql database/mutations.log database/mutations.ys")
-    task.wait()
+    generate_mutations(cfg, "mutations", cfg.opt_size, nproc)
 
     log_step("Initializing database.")
 
@@ -494,7 +2281,8 @@ def init_command(force, nosetup, trace):
     db.executescript("""
         CREATE TABLE mutations (
             mutation_id INTEGER PRIMARY KEY,
-            mutation STRING
+            mutation STRING,
+            logic_hash STRING
         );
 
         CREATE TABLE options (
@@ -504,24 +2292,16 @@ def init_command(force, nosetup, trace):
         );
 
         CREATE TABLE sources (
-            srctag STRING
+            srctag STRING,
+            file_id INTEGER,
+            line_start INTEGER,
+            col_start INTEGER,
+            line_end INTEGER,
+            col_end INTEGER
         );
 
-        CREATE TABLE results (
-            mutation_id INTEGER,
-            test STRING,
-            result STRING
-        );
-
-        CREATE TABLE tags (
-            mutation_id INTEGER,
-            tag STRING
-        );
-
-        CREATE TABLE queue (
-            mutation_id INTEGER,
-            test STRING,
-            running BOOL
+        CREATE TABLE schema (
+            version INTEGER
         );
 
         CREATE TABLE files (
@@ -530,23 +2310,24 @@ def init_command(force, nosetup, trace):
         );
     """)
 
+    db.executescript(INTERNED_SCHEMA)
+    db.executescript(SRCLOC_SCHEMA)
+    db.executescript(LINE_TAGS_SCHEMA)
+    db.executescript(EXECUTIONS_SCHEMA)
+    db.executescript(PRUNED_SCHEMA)
+    db.executescript(OBSERVABLE_SCHEMA)
+    db.executescript(SCHEMA_INDEXES)
+    db.execute("INSERT INTO schema (version) VALUES (?)", [SCHEMA_VERSION])
+
     log_step("Importing mutations.")
     with open("database/mutations.txt", "r") as f:
-        for line in f:
-            mid = db.execute("INSERT INTO mutations (mutation) VALUES (?)", [line.rstrip()]).lastrowid
-            optarray = line.split()
-            skip_next = False
-            for i in range(len(optarray)-1):
-                if skip_next:
-                    skip_next = False
-                elif optarray[i].startswith("-"):
-                    db.execute("INSERT INTO options (mutation_id, opt_type, opt_value) VALUES (?, ?, ?)", [mid, optarray[i][1:], optarray[i+1]])
-                    skip_next = True
+        import_mutations(db, f)
 
     log_step("Importing design sources.")
+    srclocs = SourceLocations(db)
     with open("database/sources.txt", "r") as f:
-        for line in f:
-            db.execute("INSERT INTO sources (srctag) VALUES (?)", [line.strip()])
+        db.executemany("INSERT INTO sources (srctag, file_id, line_start, col_start, line_end, col_end) VALUES (?, ?, ?, ?, ?, ?)",
+                ((line.strip(),) + (srclocs.parse(line.strip())[:1] or [(None,) * 5])[0] for line in f))
 
     for db_filename, os_filename in cfg.files.items():
         with open(os_filename, "rb") as f:
@@ -554,14 +2335,19 @@ def init_command(force, nosetup, trace):
 
     db.commit()
 
+    if prune:
+        prune_mutations(db, cfg, nproc)
+        db.commit()
+
     log_step("Reseting database statistics.")
-    reset_status(db, cfg, True)
+    reset_status(db, cfg, True, nproc)
 
     exit_mcy(0)
 
 @cli.command(name='reset')
+@click.option('-j', '--nproc', default=os.cpu_count(), show_default=True, help='Number of processes evaluating [logic].')
 @click.option('--trace', help='Trace database operations.', is_flag=True)
-def reset_command(trace):
+def reset_command(nproc, trace):
     """Reset database"""
     global DBTRACE
     DBTRACE = trace
@@ -569,7 +2355,28 @@ def reset_command(trace):
 
     cfg = read_cfg()
     db = sqlite3_connect(chkexist=True)
-    reset_status(db, cfg, True)
+    reset_status(db, cfg, True, nproc)
+    print_report(db, cfg)
+    exit_mcy(0)
+
+@cli.command(name='prune')
+@click.option('-j', '--nproc', default=os.cpu_count(), show_default=True, help='Number of yosys processes.')
+@click.option('--trace', help='Trace database operations.', is_flag=True)
+def prune_command(nproc, trace):
+    """Find no-op and duplicate mutations"""
+    global DBTRACE
+    DBTRACE = trace
+    log_info("Prune mutations")
+
+    cfg = read_cfg()
+    db = sqlite3_connect(chkexist=True)
+    changed = prune_mutations(db, cfg, nproc)
+    log_step(f"Update {len(changed)} mutations.")
+    for mid in changed:
+        update_mutation(db, cfg, mid)
+    share_results(db, cfg)
+    commit_results(db, force=True)
+    reset_status(db, cfg, False)
     print_report(db, cfg)
     exit_mcy(0)
 
@@ -584,9 +2391,43 @@ def status_command(trace):
     cfg = read_cfg()
     db = sqlite3_connect(chkexist=True)
     reset_status(db, cfg, False)
+    print_executions(db)
     print_report(db, cfg)
     exit_mcy(0)
 
+@cli.command(name='migrate')
+@click.option('--trace', help='Trace database operations.', is_flag=True)
+def migrate_command(trace):
+    """Upgrade database schema"""
+    global DBTRACE
+    DBTRACE = trace
+    log_info("Upgrade database schema")
+
+    read_cfg()
+    db = sqlite3_connect(chkexist=True, chkschema=False)
+    version = schema_version(db)
+    if version > SCHEMA_VERSION:
+        check_schema(db)
+    if version == SCHEMA_VERSION:
+        log_step(f"Database already uses schema version {version}.")
+    while version < SCHEMA_VERSION:
+        version += 1
+        log_step(f"Upgrading to schema version {version}.")
+        # each step is one transaction together with the new version, so an
+        # interrupted upgrade can be run again
+        db.execute("BEGIN")
+        try:
+            MIGRATIONS[version](db)
+            if version == SCHEMA_VERSION:
+                execute_schema(db, SCHEMA_INDEXES)
+            db.execute("DELETE FROM schema")
+            db.execute("INSERT INTO schema (version) VALUES (?)", [version])
+            db.commit()
+        except BaseException:
+            db.rollback()
+            raise
+    exit_mcy(0)
+
 @cli.command(name='purge')
 def purge_command():
     """Purge database"""
@@ -630,6 +2471,8 @@ def list_command(filter, output, details, trace):
     if details:
         print(file=output)
 
+    # entries whose lease expired are pending again, as in reset_status
+    now = time.time()
     for mid, mut in db.execute("SELECT mutation_id, mutation FROM mutations"):
         if len(whitelist) > 0 and mid not in whitelist:
             continue
@@ -640,7 +2483,7 @@ def list_command(filter, output, details, trace):
             found_tags = True
         if not found_tags:
             print(" no-tags", end="", file=output)
-        for tst, rn in db.execute("SELECT test, running FROM queue WHERE mutation_id = ?", [mid]):
+        for tst, rn in db.execute("SELECT test, IFNULL(lease_expiry, 0) >= ? FROM queue WHERE mutation_id = ?", [now, mid]):
             if rn:
                 print(f" [{tst}]", end="", file=output)
             else:
@@ -655,42 +2498,216 @@ def list_command(filter, output, details, trace):
 
     exit_mcy(0)
 
-def run_task(db, cfg, whitelist, tst=None, mut_list=None, verbose=False, details=False, keepdir=False):
-    """Run task"""
-    if tst is None or mut_list is None:
-        assert tst is None
-        assert mut_list is None
-        db.execute("BEGIN EXCLUSIVE")
-
-        # Find test for next task
-        entry = db.execute("SELECT test, COUNT(*) as cnt FROM queue WHERE running = 0 AND " + whitelist + " GROUP BY test ORDER BY cnt DESC LIMIT 1").fetchone()
-        if entry is None:
-            db.commit()
-            return False
-        tst, _ = entry
-        t = tst.split()[0]
-        tst_args = tst.lstrip()[len(t)+1:]
+def filter_whitelist(db, filter):
+    """Return SQL condition on mutation_id for a list of mutations or tag names"""
+    if len(filter) == 0:
+        return "1"
+    mut_list = set()
+    for arg in filter:
+        if re.match("^[0-9]+$", arg):
+            mut_list.add(int(arg))
+        else:
+            for mut, in db.execute("SELECT mutation_id FROM tags WHERE tag = ?", [arg]):
+                mut_list.add(mut)
+    return "mutation_id IN (%s)" % ", ".join(str(mut) for mut in sorted(mut_list))
 
-        # Find mutations for next task
-        mut_list = list([mut for mut, in db.execute("SELECT mutation_id FROM queue WHERE running = 0 AND test = ? AND " + whitelist + " ORDER BY mutation_id ASC LIMIT ?", [tst, cfg.tests[t].maxbatchsize])])
-    else:
-        t = tst.split()[0]
-        tst_args = tst.lstrip()[len(t)+1:]
+class QueueMirror:
+    """Pending queue entries, kept in memory by the process claiming them
 
-    # Mark tests running in DB (if we are killed after this, "mcy reset" is needed to re-create the queue entries)
-    task_id = str(uuid.uuid4())
-    log_sub_info(f"Running task {task_id} ({tst})")
+       Entries are ordered per test by mutation id, or by queue order for the
+       fifo policy. Entries queued by other processes, or returned by crashed
+       ones, are only seen when the mirror is reloaded from the database."""
+    def __init__(self, db, whitelist, policy):
+        """constructor"""
+        self.db = db
+        self.whitelist = whitelist
+        self.fifo = policy == "fifo"
+        self.allowed = None
+        if whitelist != "1":
+            self.allowed = set(mid for mid, in db.execute("SELECT mutation_id FROM mutations WHERE " + whitelist))
+        self.load()
+
+    def load(self):
+        """Read all pending entries from the database"""
+        self.pending = dict()
+        self.heaps = dict()
+        self.seq = 0
+        for seq, mid, tst in self.db.execute("""SELECT queue_data.rowid, mutation_id, test FROM queue_data JOIN tests USING (test_id)
+                WHERE (running = 0 OR lease_expiry < ?) AND """ + self.whitelist + " ORDER BY queue_data.rowid", [time.time()]):
+            self.add(mid, tst, seq)
+        self.loaded = time.time()
+
+    def add(self, mid, tst, seq=None):
+        """Add a pending entry"""
+        if self.allowed is not None and mid not in self.allowed:
+            return
+        self.seq = self.seq + 1 if seq is None else seq
+        self.pending.setdefault(tst, set()).add(mid)
+        heapq.heappush(self.heaps.setdefault(tst, list()), (self.seq if self.fifo else mid, mid))
+
+    def discard(self, mid, tst):
+        """Remove an entry, if pending"""
+        if tst in self.pending:
+            self.pending[tst].discard(mid)
+
+    def candidates(self):
+        """Tests with pending entries, with their count and first position"""
+        candidates = list()
+        for tst, mids in self.pending.items():
+            heap = self.heaps[tst]
+            # entries removed from pending are dropped from the heap lazily
+            while len(heap) and heap[0][1] not in mids:
+                heapq.heappop(heap)
+            if len(mids):
+                candidates.append(types.SimpleNamespace(test=tst, count=len(mids), first=heap[0][0]))
+        return candidates
+
+    def pop(self, tst, count):
+        """Remove and return the first count pending entries of a test"""
+        mids, heap = self.pending[tst], self.heaps[tst]
+        mut_list = list()
+        while len(mut_list) < count and len(heap):
+            _, mid = heapq.heappop(heap)
+            if mid in mids:
+                mids.remove(mid)
+                mut_list.append(mid)
+        return mut_list
+
+def claim_task(db, cfg, whitelist, free, policy="largest", busy=None):
+    """Pick test and mutations for the next task and mark them running
+
+       Returns None if nothing is queued, and BLOCKED if the next test does
+       not fit into the free resources (tests are not reordered to fill the
+       gap, so tests needing many resources can not starve). busy tells if
+       tasks of this process are outstanding, by default if any are running."""
+    global QUEUE
+    if QUEUE is None or QUEUE.whitelist != whitelist:
+        QUEUE = QueueMirror(db, whitelist, policy)
+
+    reloaded = False
+    while True:
+        candidates = QUEUE.candidates()
+        if len(candidates) == 0:
+            # Look for entries of other processes once our own are done,
+            # and while our tasks are running at most once per second
+            if busy is None:
+                busy = len(TASKDB) > 0
+            if reloaded or (busy and time.time() - QUEUE.loaded < COMMIT_INTERVAL):
+                return None
+            QUEUE.load()
+            reloaded = True
+            continue
 
-    if verbose:
-        log_sub_step("Set status to 'RUNNING' for task.")
+        entry = POLICIES[policy](candidates)
+        tst = entry.test
+        t = tst.split()[0]
+        if (t not in cfg.tests):
+            log_error(f"Test '{t}' not found.")
+        cores, memory = task_resources(cfg, tst, free.budget)
+        if not free.idle and (cores > free.cores or (free.budget.memory and memory > free.memory)):
+            return BLOCKED
+        batchsize = auto_batchsize(cfg, tst, entry.count, max(1, getattr(free, "slots", free.budget.cores) // cores))
+
+        # Entries taken by another process since the mirror was loaded are
+        # skipped. The claims are committed with the next batch of results.
+        test_id, = db.execute("SELECT test_id FROM tests WHERE test = ?", [tst]).fetchone()
+        mut_list = list()
+        now = time.time()
+        if LEASE is None:
+            init_lease(db)
+        for mut in QUEUE.pop(tst, batchsize):
+            if db.execute("UPDATE queue_data SET running = 1, lease_owner = ?, lease_expiry = ? WHERE mutation_id = ? AND test_id = ? AND (running = 0 OR lease_expiry < ?)",
+                    [LEASE.owner, now + LEASE_TIME, mut, test_id, now]).rowcount:
+                RUNNING.add((mut, tst))
+                mut_list.append(mut)
+        if len(mut_list):
+            return tst, mut_list
+
+BLOCKED = "blocked"
+
+def mark_running(db, tst, mut_list, commit=True):
+    """Lease queue entries to this process and set their status to 'RUNNING'"""
+    # If we are killed after this, the lease expires and the entries are
+    # reclaimed by the next claim_task(), in this or any other process.
+    if LEASE is None:
+        init_lease(db)
     for mut in mut_list:
-        db.execute("UPDATE queue SET running = 1 WHERE mutation_id = ? AND test = ?", [mut, tst])
+        db.execute("UPDATE queue_data SET running = 1, lease_owner = ?, lease_expiry = ? WHERE mutation_id = ? AND test_id = (SELECT test_id FROM tests WHERE test = ?)",
+                [LEASE.owner, time.time() + LEASE_TIME, mut, tst])
         RUNNING.add((mut, tst))
+        if QUEUE is not None:
+            QUEUE.discard(mut, tst)
+    if commit:
+        db.commit()
+
+def release_running(db, tst, mut_list):
+    """Return queue entries of unfinished tests to pending state"""
+    for mut in mut_list:
+        db.execute("UPDATE queue_data SET running = 0, lease_owner = NULL, lease_expiry = NULL WHERE mutation_id = ? AND test_id = (SELECT test_id FROM tests WHERE test = ?)", [mut, tst])
+        RUNNING.discard((mut, tst))
+        if QUEUE is not None:
+            QUEUE.add(mut, tst)
     db.commit()
 
+def queue_pending(db, whitelist):
+    """Check for queue entries not running yet"""
+    return db.execute("SELECT COUNT(*) FROM queue_data WHERE (running = 0 OR lease_expiry < ?) AND " + whitelist, [time.time()]).fetchone()[0] > 0
+
+def mutation_list(db, mut_list):
+    """Return (mutation_id, mutation) pairs for a list of mutation ids"""
+    mutations = list()
+    for mut in mut_list:
+        try:
+            mut_str, = db.execute("SELECT mutation FROM mutations WHERE mutation_id = ?", [mut]).fetchone()
+        except Exception:
+            log_error(f"Mutation number '{mut}' not found in database.")
+        mutations.append((mut, mut_str))
+    return mutations
+
+def record_result(db, cfg, tst, mut, res, limit=None):
+    """Store a test result and re-evaluate the mutation's logic
+
+       limit is the limit the task was killed for, if the result is the one
+       configured for it."""
+    t = tst.split()[0]
+    if cfg.tests[t].expect is not None:
+        if not res in cfg.tests[t].expect:
+            log_error(f"Executing {tst} resulted with {res} expecting value(s): {', '.join(cfg.tests[t].expect)}")
+    db.execute("DELETE FROM result_data WHERE mutation_id = ? AND test_id = (SELECT test_id FROM tests WHERE test = ?)", [mut, tst])
+    db.execute("INSERT INTO results (mutation_id, test, result) VALUES (?, ?, ?)", [mut, tst, res])
+    # a killed task may succeed in a run with more resources
+    if limit is None:
+        cache_store(db, cfg, mut, tst, res)
+    RUNNING.discard((mut, tst))
+    # duplicates found by 'mcy prune' share the result, it is copied first
+    # so the representative does not keep the test queued for them
+    dups = [dup for dup, in db.execute("SELECT mutation_id FROM pruned WHERE representative = ?", [mut])]
+    for dup in dups:
+        db.execute("DELETE FROM result_data WHERE mutation_id = ? AND test_id = (SELECT test_id FROM tests WHERE test = ?)", [dup, tst])
+        db.execute("INSERT INTO results (mutation_id, test, result) VALUES (?, ?, ?)", [dup, tst, res])
+    record_outcome(tst, res, len(update_mutation(db, cfg, mut)) == 0)
+    for dup in dups:
+        update_mutation(db, cfg, dup)
+    commit_results(db)
+
+def start_task(cfg, tst, mutations, on_result, on_finish=None, budget=None, verbose=False, details=False, keepdir=False):
+    """Start a task running a test on a list of (mutation_id, mutation) pairs"""
+    t = tst.split()[0]
+    tst_args = tst.lstrip()[len(t)+1:]
+    if (t not in cfg.tests):
+        log_error(f"Test '{t}' not found.")
+
+    task_id = str(uuid.uuid4())
+    log_sub_info(f"Running task {task_id} ({tst})")
+
     if verbose:
         log_sub_step(f"Make 'tasks/{task_id}' subdirectory.")
-    os.makedirs("tasks/%s" % task_id)
+    # another process may remove the empty 'tasks' directory in between
+    while not os.path.isdir("tasks/%s" % task_id):
+        try:
+            os.makedirs("tasks/%s" % task_id)
+        except FileNotFoundError:
+            pass
 
     infomsgs = list()
     infomsgs.append("task %s (%s)" % (task_id, tst))
@@ -698,43 +2715,66 @@ def run_task(db, cfg, whitelist, tst=None, mut_list=None, verbose=False, details
         log_sub_step(f"Task {task_id} ({tst}) started.")
 
     with open("tasks/%s/input.txt" % task_id, "w") as f:
-        for idx, mut in enumerate(mut_list):
-            try:
-                mut_str, = db.execute("SELECT mutation FROM mutations WHERE mutation_id = ?", [mut]).fetchone()
-            except Exception:
-                log_error(f"Mutation number '{mut}' not found in database.")
+        for idx, (mut, mut_str) in enumerate(mutations):
             infomsgs.append("  %d %d %s" % (idx+1, mut, mut_str))
             print(f" {(idx+1)} {mut} {mut_str}")
             print(f"{(idx+1)} {mut_str}", file=f)
 
+    checklist = set(range(len(mutations)))
+
+    def read_result(line, limit=None):
+        line = line.split()
+        if (len(line) != 2):
+            log_error(f"Invalid line format in file tasks/{task_id}/output.txt")
+
+        idx = int(line[0])-1
+        if not idx in checklist:
+            log_error(f"Unknown mutation {idx+1} in file tasks/{task_id}/output.txt")
+        checklist.remove(idx)
+        mut, mut_str = mutations[idx]
+        res = line[1]
+        on_result(idx, res, limit)
+        print(f"  {idx+1} {mut} {res} {mut_str}")
+
+    # With streaming enabled, each result is recorded as soon as the test
+    # script writes its line, not when the whole batch has finished.
+    stream = None
+    if cfg.tests[t].stream:
+        init_events()
+        if EVENTS is not None:
+            stream = ResultStream("tasks/%s/output.txt" % task_id, read_result)
+
     def callback():
         log_sub_info(f"Finishing task {task_id} ({tst})")
-        checklist = set(mut_list)
         if verbose:
             log_sub_step(f"Results:")
-        with open("tasks/%s/output.txt" % task_id, "r") as f:
-            for line in f:
-                line = line.split()
-                if (len(line) != 2):                   
-                    log_error(f"Invalid line format in file tasks/{task_id}/output.txt")
-
-                idx = int(line[0])-1
-                mut = mut_list[idx]
-                if not mut in checklist:
-                    log_error(f"Unknown mutation {mut} in file tasks/{task_id}/output.txt")
-                res = line[1]
-                if cfg.tests[t].expect is not None:
-                    if not res in cfg.tests[t].expect:
-                        log_error(f"Executing {tst} resulted with {res} expecting value(s): {', '.join(cfg.tests[t].expect)}")
-                db.execute("DELETE FROM results WHERE mutation_id = ? AND test = ?", [mut, tst])
-                db.execute("INSERT INTO results (mutation_id, test, result) VALUES (?, ?, ?)", [mut, tst, res])
-                update_mutation(db, cfg, mut)
-                RUNNING.remove((mut, tst))
-                checklist.remove(mut)
-                print(f"  {idx+1} {mut} {res} {mut_str}")
+        if stream is not None:
+            stream.close()
+        elif task.limit_hit is None:
+            with open("tasks/%s/output.txt" % task_id, "r") as f:
+                for line in f:
+                    read_result(line)
+
+        usage = f"{task.endtime - task.starttime:.2f}s wall time"
+        if task.cputime() is not None:
+            usage += f", {task.cputime():.2f}s CPU time"
+        if task.peakmemory is not None:
+            usage += f", {task.peakmemory // 1024} kB peak memory"
+        if task.limit_hit is not None:
+            res = cfg.tests[t].limits[task.limit_hit][1]
+            log_sub_info(f"Task {task_id} ({tst}) exceeded its {task.limit_hit} after {usage}.")
+            for idx in sorted(checklist):
+                read_result(f"{idx+1} {res}", task.limit_hit)
 
         if len(checklist) != 0:
             log_error("Empty mutation checklist.")
+        # a killed task says nothing about the runtime of a complete batch
+        if task.limit_hit is None:
+            record_runtime(tst, len(mutations), task.endtime - task.starttime, task.cputime())
+        if verbose and task.limit_hit is None:
+            log_sub_step(f"Task used {usage}.")
+        if on_finish is not None:
+            on_finish(task)
         if not keepdir:
             if verbose:
                 log_sub_step(f"Remove 'tasks/{task_id}' subdirectory.")
@@ -743,11 +2783,9 @@ def run_task(db, cfg, whitelist, tst=None, mut_list=None, verbose=False, details
                 os.rmdir("tasks/")
             except OSError:
                 pass
-    script_path = root_path() + '/../share/mcy/scripts' # for install
-    if (not os.path.exists(script_path)):
-        script_path = root_path() + '/scripts' # for development
+    script_path = scripts_path()
     command = "export TASK=%s PRJDIR=\"$PWD\" KEEPDIR=%d MUTATIONS=\"%s\" SCRIPTS=\"%s\"; cd tasks/$TASK; export TASKDIR=\"$PWD\"" % \
-            (task_id, 1 if keepdir else 0, " ".join(["%d" % mut for mut in mut_list]), script_path)
+            (task_id, 1 if keepdir else 0, " ".join(["%d" % mut for mut, _ in mutations]), script_path)
     logfilename = None
     if not details:
         with open("tasks/%s/logfile.txt" % task_id, "w") as f:
@@ -755,21 +2793,127 @@ def run_task(db, cfg, whitelist, tst=None, mut_list=None, verbose=False, details
                 print(msg, file=f)
         command += "; exec >>logfile.txt"
         logfilename = "tasks/%s/logfile.txt" % task_id
-    if (t not in cfg.tests):
-        log_error(f"Test '{t}' not found.")
     command += f"; {cfg.tests[t].run} {tst_args}"
-    task = Task(command, callback, silent=(not details), logfilename=logfilename)
+    cores, memory = task_resources(cfg, tst, budget if budget is not None else default_budget(os.cpu_count(), 0))
+    task = Task(command, callback, silent=(not details), logfilename=logfilename, cores=cores, memory=memory, limits=cfg.tests[t].limits)
+    task.task_id = task_id
+    task.batch = len(mutations)
+    return task
+
+def run_task(db, cfg, whitelist, tst=None, mut_list=None, budget=None, policy="largest", verbose=False, details=False, keepdir=False):
+    """Run task (returns None if the next task has to wait for resources)"""
+    if budget is None:
+        budget = default_budget(1)
+    if tst is None or mut_list is None:
+        assert tst is None
+        assert mut_list is None
+        free = free_resources(budget)
+        free.budget = budget
+        claimed = claim_task(db, cfg, whitelist, free, policy)
+        if claimed is None:
+            return False
+        if claimed is BLOCKED:
+            return None
+        tst, mut_list = claimed
+    else:
+        if (tst.split()[0] not in cfg.tests):
+            log_error(f"Test '{tst.split()[0]}' not found.")
+        mark_running(db, tst, mut_list)
+
+    def on_result(idx, res, limit=None):
+        record_result(db, cfg, tst, mut_list[idx], res, limit)
+
+    def on_finish(task):
+        record_task(db, tst, task)
+        commit_results(db, force=True)
+
+    start_task(cfg, tst, mutation_list(db, mut_list), on_result, on_finish, budget=budget, verbose=verbose, details=details, keepdir=keepdir)
     return True
 
+def count_results(db):
+    """Initialize result frequencies of all tests from the database"""
+    for tst, res, cnt in db.execute("""SELECT test, result, cnt FROM
+            (SELECT test_id, result_id, COUNT(*) AS cnt FROM result_data GROUP BY test_id, result_id)
+            JOIN tests USING (test_id) JOIN result_values USING (result_id)"""):
+        counts = test_stats(tst).counts
+        counts[res] = counts.get(res, 0) + cnt
+
+def predict_test(db, cfg, mid, depth=4):
+    """Predict the next test needed for a mutation once its running tests are done
+
+       Returns False if there are no results yet to base the prediction on."""
+    assumed = dict()
+    for _ in range(depth):
+        _, tsts = eval_logic(db, cfg, mid, assumed)
+        if len(tsts) == 0:
+            return None
+        for tst in tsts:
+            if (mid, tst) not in RUNNING:
+                return tst
+        for tst in tsts:
+            assumed[tst] = likely_result(tst)
+            if assumed[tst] is None:
+                return False
+    return None
+
+def speculate_task(db, cfg, state, budget, verbose=False):
+    """Run a test that the [logic] of running mutations will likely need next"""
+    # Mutations are only examined again once a test's likely result changes
+    modes = {tst: likely_result(tst) for tst in TESTSTATS}
+    if modes != state.modes:
+        state.modes = modes
+        state.checked.clear()
+        state.pool.clear()
+
+    for mid, tst in list(RUNNING):
+        if (mid, tst) in SPECULATING or (mid, tst) in state.checked:
+            continue
+        next_tst = predict_test(db, cfg, mid)
+        if next_tst is False:
+            continue
+        state.checked.add((mid, tst))
+        if next_tst is not None and next_tst.split()[0] in cfg.tests:
+            state.pool.setdefault(next_tst, list()).append(mid)
+
+    for tst in sorted(state.pool, key=lambda tst: -len(state.pool[tst])):
+        mids = [mid for mid in state.pool[tst] if (mid, tst) not in RUNNING]
+        if len(mids) == 0:
+            del state.pool[tst]
+            continue
+        free = free_resources(budget)
+        cores, memory = task_resources(cfg, tst, budget)
+        if cores > free.cores or (budget.memory and memory > free.memory):
+            return False
+        batchsize = auto_batchsize(cfg, tst, len(mids), max(1, budget.cores // cores))
+        mut_list, state.pool[tst] = mids[:batchsize], mids[batchsize:]
+        if verbose:
+            log_sub_step(f"Speculatively running {tst} for {len(mut_list)} mutation(s).")
+        for mut in mut_list:
+            SPECULATING.add((mut, tst))
+            RUNNING.add((mut, tst))
 
+        def on_result(idx, res, limit=None):
+            SPECULATING.discard((mut_list[idx], tst))
+            record_result(db, cfg, tst, mut_list[idx], res, limit)
+
+        def on_finish(task):
+            record_task(db, tst, task)
+            commit_results(db, force=True)
+
+        start_task(cfg, tst, mutation_list(db, mut_list), on_result, on_finish, budget=budget, verbose=verbose)
+        return True
+    return False
 
 @cli.command(name='run', short_help='Run all tasks')
 @click.argument('filter', nargs=-1)
 @click.option('-j', '--nproc', default=os.cpu_count(), show_default=True, help='Number of build process.')
+@click.option('-m', '--memory', help='Memory available to tasks (default: physical memory).')
 @click.option('-v', '--verbose', help='Verbose output.', is_flag=True)
 @click.option('--reset', help='Reset database before run.', is_flag=True)
+@click.option('--policy', type=click.Choice(list(POLICIES)), default='largest', show_default=True, help='Policy for choosing the test of the next task.')
+@click.option('--speculate', help='Use idle cores for tests likely needed next.', is_flag=True)
 @click.option('--trace', help='Trace database operations.', is_flag=True)
-def run_command(filter, nproc, verbose, reset, trace):
+def run_command(filter, nproc, memory, verbose, reset, policy, speculate, trace):
     """Run all tasks\b
 
        Run all tasks from queue.
@@ -780,32 +2924,312 @@ def run_command(filter, nproc, verbose, reset, trace):
 
     cfg = read_cfg()
     db = sqlite3_connect(chkexist=True)
-    whitelist = "1"
-
-    if len(filter) > 0:
-        whitelist = "("
-        for arg in filter:
-            if whitelist != "(":
-                whitelist += " OR "
-            if re.match("^[0-9]+$", arg):
-                whitelist += f"mutation_id = {int(arg)}"
-            else:
-                for mut, in db.execute("SELECT mutation_id FROM tags WHERE tag = ?", [arg]):
-                    whitelist += f"mutation_id = {mut}"
-        whitelist += ")"
+    init_lease(db)
+    load_executions(db)
+    whitelist = filter_whitelist(db, filter)
+    budget = default_budget(nproc, None if memory is None else parse_size(memory))
 
     if reset:
-        reset_status(db, True)
-
-    while run_task(db, cfg, whitelist, verbose = verbose) or len(TASKDB):
-        wait_tasks(nproc)
+        reset_status(db, cfg, True, nproc)
+
+    starttime = time.time()
+    firsttask = TASKIDX
+    speculation = types.SimpleNamespace(checked=set(), pool=dict(), modes=None)
+    if speculate:
+        count_results(db)
+    while True:
+        started = run_task(db, cfg, whitelist, budget = budget, policy = policy, verbose = verbose)
+        if started is False and speculate and len(TASKDB):
+            started = speculate_task(db, cfg, speculation, budget, verbose = verbose)
+        if started:
+            wait_tasks(nproc)
+        elif len(TASKDB):
+            wait_progress()
+        else:
+            break
 
     wait_tasks(1)
-    log_step("Finished running all tasks.")
+    ntasks, runtime = TASKIDX - firsttask, time.time() - starttime
+    log_step(f"Finished running all tasks ({ntasks} tasks in {runtime:.2f}s, {ntasks / max(runtime, 1e-6):.1f} tasks/s).")
+    reset_status(db, cfg)
+    print_report(db, cfg)
+    exit_mcy(0)
+
+class Connection:
+    """Line-delimited JSON messages over a socket, read from the event loop"""
+    def __init__(self, sock, handler, on_close=None):
+        """constructor"""
+        self.sock = sock
+        self.handler = handler
+        self.on_close = on_close
+        self.buffer = b""
+        self.open = True
+        self.lastseen = time.time()
+        EVENTS.register(sock, selectors.EVENT_READ, self.read)
+
+    def send(self, **msg):
+        """Send a message, closing the connection on error"""
+        try:
+            self.sock.sendall((json.dumps(msg) + "\n").encode())
+        except OSError:
+            self.close()
+
+    def read(self, sock=None):
+        """Read available data and handle complete messages"""
+        try:
+            data = self.sock.recv(65536)
+        except OSError:
+            data = b""
+        if not data:
+            self.close()
+            return
+        self.lastseen = time.time()
+        self.buffer += data
+        *lines, self.buffer = self.buffer.split(b"\n")
+        for line in lines:
+            if self.open:
+                self.handler(self, json.loads(line))
+
+    def close(self):
+        """Close the connection"""
+        if not self.open:
+            return
+        self.open = False
+        EVENTS.unregister(self.sock)
+        self.sock.close()
+        if self.on_close is not None:
+            self.on_close(self)
+
+def valid_test(cfg, tst):
+    """Check that a test invocation received from a coordinator names a
+       configured test and only has arguments safe to put on a command line"""
+    entries = tst.split()
+    return len(entries) > 0 and entries[0] in cfg.tests and \
+            all(re.match(r"^[A-Za-z0-9_.,:+=@%/-]+$", arg) for arg in entries[1:])
+
+def file_digest(filename):
+    """Return SHA-256 of a file, None if it does not exist"""
+    if not os.path.exists(filename):
+        return None
+    with open(filename, "rb") as f:
+        return hashlib.sha256(f.read()).hexdigest()
+
+@cli.command(name='serve', short_help='Serve tasks to workers')
+@click.argument('filter', nargs=-1)
+@click.option('-p', '--port', default=5470, show_default=True, help='TCP port to listen on.')
+@click.option('--bind', default='127.0.0.1', show_default=True, help='Address to listen on.')
+@click.option('--token', envvar='MCY_TOKEN', help='Shared secret of coordinator and workers (default: random, printed at start).')
+@click.option('--policy', type=click.Choice(list(POLICIES)), default='largest', show_default=True, help='Policy for choosing the test of the next task.')
+@click.option('--lease-timeout', default=60, show_default=True, help='Seconds without message until a worker\'s tasks are reclaimed.')
+@click.option('--trace', help='Trace database operations.', is_flag=True)
+def serve_command(filter, port, bind, token, policy, lease_timeout, trace):
+    """Serve tasks to workers\b
+
+       Run all tasks from queue on workers connecting via TCP (see 'mcy worker').
+       Optionally FILTER by list of mutations or tag names can be provided."""
+    global DBTRACE
+    DBTRACE = trace
+    log_info("Serve all tasks from queue")
+
+    cfg = read_cfg()
+    db = sqlite3_connect(chkexist=True)
+    init_lease(db)
+    load_executions(db)
+    whitelist = filter_whitelist(db, filter)
+    design_digest = file_digest("database/design.il")
+    if token is None:
+        token = secrets.token_hex(16)
+        log_step(f"Workers must connect with '--token {token}'.")
+
+    init_events()
+    workers = set()
+    requests = list()
+    leases = dict()
+
+    def reclaim(lease_id):
+        lease = leases.pop(lease_id)
+        if len(lease.pending):
+            log_sub_step(f"Returning {len(lease.pending)} mutation(s) of lease {lease_id} to queue.")
+            release_running(db, lease.tst, [lease.mut_list[idx] for idx in lease.pending])
+
+    def handle(conn, msg):
+        op = msg.get("op")
+        if op == "hello":
+            if not hmac.compare_digest(str(msg.get("token")), token):
+                log_warning(f"Rejected worker at {conn.sock.getpeername()[0]} with wrong token.")
+                conn.close()
+                return
+            conn.name = f"{msg['host']}:{conn.sock.getpeername()[1]}"
+            conn.host = msg["host"]
+            conn.slots = msg["slots"]
+            conn.budget = types.SimpleNamespace(cores=msg["slots"], memory=msg["memory"])
+            conn.sent = 0
+            log_sub_info(f"Worker {conn.name} connected with {conn.slots} slot(s).")
+            reply = dict(op="welcome")
+            if msg.get("design") != design_digest:
+                with open("database/design.il", "r") as f:
+                    reply["design"] = f.read()
+            conn.send(**reply)
+        elif not hasattr(conn, "name"):
+            conn.close()
+        elif op == "lease":
+            # Requests are replaced when the worker's free resources change,
+            # those sent before the worker saw our last task are outdated.
+            if msg["granted"] < conn.sent:
+                return
+            conn.request = types.SimpleNamespace(cores=msg["cores"], memory=msg["memory"], idle=msg["idle"], budget=conn.budget)
+            if conn not in requests:
+                requests.append(conn)
+        elif op == "result":
+            lease = leases.get(msg["lease"])
+            if lease is None or lease.conn is not conn or msg["idx"] not in lease.pending:
+                return
+            lease.pending.remove(msg["idx"])
+            record_result(db, cfg, lease.tst, lease.mut_list[msg["idx"]], msg["result"], msg.get("limit"))
+        elif op == "finish":
+            lease = leases.get(msg["lease"])
+            if lease is None or lease.conn is not conn:
+                return
+            log_sub_info(f"Finishing lease {msg['lease']} ({lease.tst}) on {conn.name}")
+            if msg.get("limit") is None:
+                record_runtime(lease.tst, len(lease.mut_list), msg["runtime"], msg["cputime"])
+            record_execution(db, msg.get("task", msg["lease"]), lease.tst, len(lease.mut_list), msg.get("start"), msg.get("end"),
+                    msg.get("exit_code"), msg["cputime"], msg.get("peakmemory"), conn.host, msg.get("limit"))
+            reclaim(msg["lease"])
+            commit_results(db, force=True)
+
+    def on_close(conn):
+        workers.discard(conn)
+        if hasattr(conn, "name"):
+            log_sub_info(f"Worker {conn.name} disconnected.")
+        for lease_id in [lease_id for lease_id, lease in leases.items() if lease.conn is conn]:
+            reclaim(lease_id)
+
+    def accept(server):
+        sock, _ = server.accept()
+        workers.add(Connection(sock, handle, on_close))
+
+    server = socket.create_server((bind, port), reuse_port=False)
+    EVENTS.register(server, selectors.EVENT_READ, accept)
+    log_step(f"Listening on {bind}:{port}.")
+
+    starttime = time.time()
+    nleases = 0
+    while True:
+        # Hand out work to waiting workers
+        for conn in list(requests):
+            if not conn.open:
+                requests.remove(conn)
+                continue
+            conn.request.slots = sum(w.slots for w in workers if hasattr(w, "slots"))
+            claimed = claim_task(db, cfg, whitelist, conn.request, policy, busy=len(leases) > 0)
+            if claimed is None:
+                break
+            if claimed is BLOCKED:
+                continue
+            requests.remove(conn)
+            conn.sent += 1
+            tst, mut_list = claimed
+            lease_id = str(uuid.uuid4())
+            leases[lease_id] = types.SimpleNamespace(conn=conn, tst=tst, mut_list=mut_list, pending=set(range(len(mut_list))))
+            log_sub_info(f"Leasing {lease_id} ({tst}) to {conn.name}")
+            conn.send(op="task", lease=lease_id, test=tst, mutations=mutation_list(db, mut_list))
+            nleases += 1
+
+        if len(leases) == 0 and not queue_pending(db, whitelist):
+            break
+
+        wait_events(1.0)
+        commit_results(db)
+        renew_leases()
+
+        # Reclaim work of workers that went silent
+        for conn in list(workers):
+            if time.time() - conn.lastseen > lease_timeout:
+                log_warning(f"Worker {getattr(conn, 'name', '?')} timed out.")
+                conn.close()
+
+    runtime = time.time() - starttime
+    log_step(f"Finished running all tasks ({nleases} tasks in {runtime:.2f}s, {nleases / max(runtime, 1e-6):.1f} tasks/s).")
+    for conn in list(workers):
+        conn.send(op="done")
+        conn.close()
     reset_status(db, cfg)
     print_report(db, cfg)
     exit_mcy(0)
 
+@cli.command(name='worker', short_help='Run tasks for a coordinator')
+@click.argument('address', nargs=1)
+@click.option('-j', '--nproc', default=os.cpu_count(), show_default=True, help='Number of build process.')
+@click.option('-m', '--memory', help='Memory available to tasks (default: physical memory).')
+@click.option('-v', '--verbose', help='Verbose output.', is_flag=True)
+@click.option('--heartbeat', default=10, show_default=True, help='Seconds between messages to the coordinator.')
+@click.option('--token', envvar='MCY_TOKEN', required=True, help='Shared secret printed by mcy serve.')
+def worker_command(address, nproc, memory, verbose, heartbeat, token):
+    """Run tasks for a coordinator\b
+
+       Connect to 'mcy serve' at ADDRESS (host:port) and run tasks leased from it."""
+    log_info("Run tasks for coordinator")
+
+    cfg = read_cfg()
+    host, port = address.rsplit(":", 1)
+    init_events()
+    budget = default_budget(nproc, None if memory is None else parse_size(memory))
+    state = types.SimpleNamespace(requested=None, granted=0, done=False)
+
+    def handle(conn, msg):
+        op = msg.get("op")
+        if op == "welcome":
+            if "design" in msg:
+                log_step("Updating 'database/design.il' from coordinator.")
+                os.makedirs("database", exist_ok=True)
+                with open("database/design.il", "w") as f:
+                    f.write(msg["design"])
+        elif op == "task":
+            state.requested = None
+            state.granted += 1
+            lease_id = msg["lease"]
+            if not valid_test(cfg, msg["test"]):
+                log_error(f"Coordinator sent invalid test '{msg['test']}'.")
+            def on_result(idx, res, limit=None):
+                conn.send(op="result", lease=lease_id, idx=idx, result=res, limit=limit)
+            def on_finish(task):
+                conn.send(op="finish", lease=lease_id, runtime=task.endtime - task.starttime, cputime=task.cputime(),
+                        task=task.task_id, start=task.starttime, end=task.endtime, exit_code=task.p.returncode,
+                        peakmemory=task.peakmemory, limit=task.limit_hit)
+            start_task(cfg, msg["test"], [tuple(m) for m in msg["mutations"]], on_result, on_finish, budget=budget, verbose=verbose)
+        elif op == "done":
+            state.done = True
+
+    def on_close(conn):
+        if not state.done:
+            log_error("Lost connection to coordinator.")
+
+    log_step(f"Connecting to {address}.")
+    try:
+        sock = socket.create_connection((host, int(port)))
+    except OSError as e:
+        log_error(f"Could not connect to {address}: {e}")
+    conn = Connection(sock, handle, on_close)
+    conn.send(op="hello", token=token, host=socket.gethostname(), slots=budget.cores, memory=budget.memory, design=file_digest("database/design.il"))
+
+    lastsent = time.time()
+    while not state.done or len(TASKDB):
+        free = free_resources(budget)
+        request = (free.cores, free.memory, free.idle)
+        if not state.done and free.cores > 0 and request != state.requested:
+            conn.send(op="lease", granted=state.granted, cores=free.cores, memory=free.memory, idle=free.idle)
+            state.requested = request
+            lastsent = time.time()
+        wait_events(poll_timeout(heartbeat))
+        poll_tasks()
+        if not state.done and time.time() - lastsent >= heartbeat:
+            conn.send(op="heartbeat")
+            lastsent = time.time()
+
+    log_step("Finished running all tasks.")
+    exit_mcy(0)
+
 @cli.command(name='task', short_help='Run task')
 @click.argument('test', nargs=1)
 @click.argument('filter', nargs=-1)
@@ -824,6 +3248,7 @@ def task_command(test, filter, verbose, keepdir, trace):
 
     cfg = read_cfg()
     db = sqlite3_connect(chkexist=True)
+    init_lease(db)
     mut_list = list()
     for arg in filter:
         if re.match("^[0-9]+$", arg):
@@ -842,6 +3267,22 @@ def task_command(test, filter, verbose, keepdir, trace):
     log_step("Finished running task.")
     exit_mcy(0)
 
+def line_coverage(db, filename):
+    """Count covered and uncovered mutations per line of a source file
+
+       Lines with design sources but without tagged mutations have used = 0."""
+    covercache = dict()
+    file_id = db.execute("SELECT file_id FROM src_files WHERE filename = ?", [filename]).fetchone()
+    if file_id is None:
+        return covercache
+
+    for line, in db.execute("SELECT DISTINCT line_start FROM sources WHERE file_id = ?", file_id):
+        covercache[line] = types.SimpleNamespace(covered=0, uncovered=0, used=0)
+
+    for line, covered, uncovered in db.execute("SELECT line, covered, uncovered FROM line_tags WHERE file_id = ? AND tagged > 0", file_id):
+        covercache[line] = types.SimpleNamespace(covered=covered, uncovered=uncovered, used=1)
+    return covercache
+
 def filename_help(ctx, filename):
     """Display additional help and list files"""
     if filename is None:
@@ -888,34 +3329,11 @@ def source_command(ctx, filename, filepath, output, encoding, trace):
     filedata = filedata.replace("\r\n", "\n").replace("\r", "\n")
 
     log_step("Extract coverage info.")
-    covercache = dict()
-
-    for src, in db.execute("SELECT DISTINCT srctag FROM sources WHERE srctag LIKE ?", [filename + ":%"]):
-        src = src.replace(filename + ":","")
-        if ("." in src):
-            src = src[:src.index(".")]
-        covercache[src] = types.SimpleNamespace(covered=0, uncovered=0, used=0)
-
-    for src, covered, uncovered in db.execute("""
-          SELECT opt_value,
-                 COUNT(CASE WHEN tag =   'COVERED' THEN 1 END),
-                 COUNT(CASE WHEN tag = 'UNCOVERED' THEN 1 END)
-            FROM options
-            JOIN tags ON (options.mutation_id = tags.mutation_id)
-           WHERE opt_type = 'src'
-             AND opt_value LIKE ?
-        GROUP BY opt_value
-    """, [filename + ":%"]):
-        src = src.replace(filename + ":","")
-        if ("." in src):
-            src = src[:src.index(".")]
-        covercache[src].covered += covered
-        covercache[src].uncovered += uncovered
-        covercache[src].used = 1
+    covercache = line_coverage(db, filename)
 
     log_step("Display source file with info.")
     for linenr, line in enumerate(filedata.rstrip("\n").split("\n")):
-        src = f"{linenr+1}"
+        src = linenr+1
 
         if src in covercache:
             if covercache[src].used:
@@ -960,23 +3378,8 @@ def lcov_command(ctx, filename, output, encoding, trace):
     # Fix DOS-style and old Macintosh-style line endings
     filedata = filedata.replace("\r\n", "\n").replace("\r", "\n")
 
-    covercache = dict()
     log_step("Extract coverage info.")
-    for src, in db.execute("SELECT DISTINCT srctag FROM sources WHERE srctag LIKE ?", [filename + ":%"]):
-        covercache[src] = types.SimpleNamespace(covered=0, uncovered=0)
-
-    for src, covered, uncovered in db.execute("""
-          SELECT opt_value,
-                 COUNT(CASE WHEN tag =   'COVERED' THEN 1 END),
-                 COUNT(CASE WHEN tag = 'UNCOVERED' THEN 1 END)
-            FROM options
-            JOIN tags ON (options.mutation_id = tags.mutation_id)
-           WHERE opt_type = 'src'
-             AND opt_value LIKE ?
-        GROUP BY opt_value
-    """, [filename + ":%"]):
-        covercache[src].covered += covered
-        covercache[src].uncovered += uncovered
+    covercache = line_coverage(db, filename)
 
     lines_total = 0
     lines_covered = 0
@@ -984,12 +3387,12 @@ def lcov_command(ctx, filename, output, encoding, trace):
     print("TN:", file=output)
     print(f"SF:{filename}", file=output)
     for linenr, _ in enumerate(filedata.rstrip("\n").split("\n")):
-        src = f"{filename}:{linenr+1}"
+        src = linenr+1
 
         if src in covercache:
             lines_total += 1
             if covercache[src].uncovered:
-                print(f"DA:{linenr+1},0" % (linenr+1, 0), file=output)
+                print(f"DA:{linenr+1},0", file=output)
             else:
                 print(f"DA:{linenr+1},{covercache[src].covered}", file=output)
                 if (covercache[src].covered !=0):